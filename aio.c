@@ -0,0 +1,232 @@
+/* Batched asynchronous reads from disk images, so that walking many
+ * directories or a long cluster chain doesn't wait on one read at a time. */
+#include "aio.h"
+
+void read_error() {
+  printf("Error reading from disk.\n");
+  exit(1);
+}
+
+// reads the whole request, retrying short reads.
+void read_req(int fd, read_req_t req) {
+  for (int done = 0; done < req.len;) {
+    int len = pread(fd, req.buf + done, req.len - done, req.offset + done);
+    if (len <= 0) {
+      read_error();
+    }
+    done += len;
+  }
+}
+
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+typedef struct uring_t {
+  int fd;
+  unsigned *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  // the mappings, to release them when the thread exits.
+  byte *sq, *cq;
+  size_t sq_size, cq_size, sqes_size;
+} uring_t;
+
+/* Each thread has its own ring, so walk threads can batch reads at the same
+ * time. It is set up on first use, state is -1 if that failed. */
+__thread uring_t ring;
+__thread int ring_state = 0;
+pthread_key_t ring_key;
+pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+// unmaps and closes the exiting thread's ring.
+void uring_exit(void *arg) {
+  uring_t *r = arg;
+  munmap(r->sqes, r->sqes_size);
+  if (r->cq != r->sq) {
+    munmap(r->cq, r->cq_size);
+  }
+  munmap(r->sq, r->sq_size);
+  close(r->fd);
+}
+
+void make_ring_key() { pthread_key_create(&ring_key, uring_exit); }
+
+/* Sets up the ring and maps its submission and completion queues.
+ * Returns 0 if io_uring isn't available, e.g on older kernels. */
+int uring_init() {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring.fd = syscall(__NR_io_uring_setup, AIO_DEPTH, &params);
+  if (ring.fd < 0) {
+    return 0;
+  }
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  int single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    sq_size = cq_size = (sq_size > cq_size) ? sq_size : cq_size;
+  }
+  byte *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+  byte *cq = single_mmap ? sq
+                         : mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, ring.fd,
+                                IORING_OFF_CQ_RING);
+  ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+                   IORING_OFF_SQES);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || ring.sqes == MAP_FAILED) {
+    close(ring.fd);
+    return 0;
+  }
+  ring.sq = sq;
+  ring.cq = cq;
+  ring.sq_size = sq_size;
+  ring.cq_size = cq_size;
+  ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  pthread_once(&ring_once, make_ring_key);
+  pthread_setspecific(ring_key, &ring);
+  ring.sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring.sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring.sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring.cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring.cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring.cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return 1;
+}
+
+void uring_submit(int fd, read_req_t *req, int id) {
+  unsigned tail = *ring.sq_tail, index = tail & *ring.sq_mask;
+  struct io_uring_sqe *sqe = ring.sqes + index;
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long)req->buf;
+  sqe->len = req->len;
+  sqe->off = req->offset;
+  sqe->user_data = id;
+  ring.sq_array[index] = index;
+  __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Keeps up to AIO_DEPTH reads submitted, waiting for at least one to
+ * complete each time the queue is full or there is nothing left to submit.
+ * Short reads are finished off with a blocking read. */
+void uring_batch(int fd, read_req_t *reqs, int num_reqs) {
+  int submitted = 0, completed = 0, to_submit = 0;
+  while (completed < num_reqs) {
+    while (submitted < num_reqs && submitted - completed < AIO_DEPTH) {
+      uring_submit(fd, reqs + submitted, submitted);
+      submitted++;
+      to_submit++;
+    }
+    if (syscall(__NR_io_uring_enter, ring.fd, to_submit, 1,
+                IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+      read_error();
+    }
+    to_submit = 0;
+    unsigned head = *ring.cq_head;
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe *cqe = ring.cqes + (head & *ring.cq_mask);
+      read_req_t req = reqs[cqe->user_data];
+      if (cqe->res < 0) {
+        read_error();
+      } else if (cqe->res < req.len) {
+        req.buf += cqe->res;
+        req.offset += cqe->res;
+        req.len -= cqe->res;
+        read_req(fd, req);
+      }
+      head++;
+      completed++;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  }
+}
+#endif
+
+typedef struct batch_t {
+  int fd;
+  read_req_t *reqs;
+  int num_reqs;
+  int next;
+  pthread_mutex_t lock;
+} batch_t;
+
+// takes the next request off the batch until there are none left.
+void *read_worker(void *arg) {
+  batch_t *batch = arg;
+  while (1) {
+    pthread_mutex_lock(&batch->lock);
+    int i = batch->next++;
+    pthread_mutex_unlock(&batch->lock);
+    if (i >= batch->num_reqs) {
+      return NULL;
+    }
+    read_req(batch->fd, batch->reqs[i]);
+  }
+}
+
+void thread_batch(int fd, read_req_t *reqs, int num_reqs) {
+  // starting threads costs more than overlapping a few reads saves.
+  if (num_reqs < AIO_MIN_THREADED) {
+    for (int i = 0; i < num_reqs; i++) {
+      read_req(fd, reqs[i]);
+    }
+    return;
+  }
+  batch_t batch = {.fd = fd, .reqs = reqs, .num_reqs = num_reqs, .next = 0};
+  pthread_mutex_init(&batch.lock, NULL);
+  int num_threads = (num_reqs < AIO_THREADS) ? num_reqs : AIO_THREADS;
+  pthread_t threads[AIO_THREADS];
+  for (int i = 0; i < num_threads; i++) {
+    pthread_create(threads + i, NULL, read_worker, &batch);
+  }
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_mutex_destroy(&batch.lock);
+}
+
+/* Reads through the FILE, for images that have no file descriptor of their
+ * own. The FILE is locked for each seek and read, so threads can share it. */
+void stream_batch(FILE *disk, read_req_t *reqs, int num_reqs) {
+  for (int i = 0; i < num_reqs; i++) {
+    flockfile(disk);
+    if (fseek(disk, reqs[i].offset, SEEK_SET) != 0 ||
+        fread(reqs[i].buf, 1, reqs[i].len, disk) < reqs[i].len) {
+      read_error();
+    }
+    funlockfile(disk);
+  }
+}
+
+void read_batch(FILE *disk, read_req_t *reqs, int num_reqs) {
+  // make sure anything written through disk is there to be read.
+  fflush(disk);
+  int fd = fileno(disk);
+  if (fd < 0) {
+    stream_batch(disk, reqs, num_reqs);
+    return;
+  }
+  if (num_reqs == 1) {
+    // nothing to overlap with, so skip the setup.
+    read_req(fd, reqs[0]);
+    return;
+  }
+#ifdef USE_IO_URING
+  if (ring_state == 0) {
+    ring_state = uring_init() ? 1 : -1;
+  }
+  if (ring_state == 1) {
+    uring_batch(fd, reqs, num_reqs);
+    return;
+  }
+#endif
+  thread_batch(fd, reqs, num_reqs);
+}
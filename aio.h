@@ -0,0 +1,24 @@
+/* Header file for aio.c, which issues batches of reads from a disk image
+ * with many of them in flight at once. Built with USE_IO_URING it uses
+ * io_uring, otherwise (or if io_uring isn't available at runtime) a pool
+ * of threads each issuing blocking reads. */
+#include "byte.h"
+#include <pthread.h>
+
+// the most reads in flight at once.
+#define AIO_DEPTH 64
+// threads used by the fallback when io_uring isn't used.
+#define AIO_THREADS 8
+// smaller batches are read one at a time by the fallback.
+#define AIO_MIN_THREADED 4
+
+// read len bytes at offset in the disk image into buf.
+typedef struct read_req_t {
+  byte *buf;
+  long offset;
+  int len;
+} read_req_t;
+
+/* Performs all the reads, returning once every one of them is complete.
+ * Flushes disk, then reads its file descriptor directly. */
+void read_batch(FILE *disk, read_req_t *reqs, int num_reqs);
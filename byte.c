@@ -52,6 +52,21 @@ struct tm bytes_to_time(byte *time_bytes, byte *date_bytes) {
   return time;
 }
 
+/* 64-bit FNV-1a hash of the n bytes given. Not cryptographic, just cheap
+ * enough to fingerprint a whole image to make sure it is the one expected. */
+uint64_t hash_bytes(byte *bytes, long n) {
+  return hash_more(0xcbf29ce484222325ULL, bytes, n);
+}
+
+// carries on hashing from hash, as if the bytes came after the ones before.
+uint64_t hash_more(uint64_t hash, byte *bytes, long n) {
+  for (long i = 0; i < n; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
 // reads n bytes from the file starting at the given address
 byte *read_bytes(FILE *disk, int n, int address) {
   byte *buf = (byte *)malloc(n * sizeof(byte));
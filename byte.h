@@ -1,6 +1,7 @@
 /* Header file for byte.c, which has operations
  * for handling unsigned chars as bytes. And
  * dealing with raw bytes from FAT-12 filesystems. */
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,5 +19,9 @@ ushort bytes_to_ushort(byte *bytes);
 char *bytes_to_filename(byte *bytes);
 struct tm bytes_to_time(byte *time_bytes, byte *date_bytes);
 
+// hashes a byte sequence, for fingerprinting images or regions of them.
+uint64_t hash_bytes(byte *bytes, long n);
+uint64_t hash_more(uint64_t hash, byte *bytes, long n);
+
 // byte sequence read function
 byte *read_bytes(FILE *disk, int n, int address);
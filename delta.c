@@ -0,0 +1,66 @@
+/* Functions for reading and writing the delta files
+ * shared by diskdiff and diskpatch. */
+#include "delta.h"
+
+void write_delta_header(FILE *out, delta_header_t header) {
+  memcpy(header.magic, DELTA_MAGIC, 8);
+  if (fwrite(&header, sizeof(delta_header_t), 1, out) < 1) {
+    printf("Error writing delta header.\n");
+    exit(1);
+  }
+}
+
+// reads the header at the start of the delta, exits if it isn't a delta file.
+delta_header_t read_delta_header(FILE *delta) {
+  delta_header_t header;
+  if (fread(&header, sizeof(delta_header_t), 1, delta) < 1 ||
+      memcmp(header.magic, DELTA_MAGIC, 8) != 0) {
+    printf("Error: not a valid delta file.\n");
+    exit(1);
+  }
+  return header;
+}
+
+uint64_t live_hash(byte *image, long size, fat_table_t *fat) {
+  uint64_t hash = hash_bytes(NULL, 0);
+  for (long sector = 0; sector < size / SECTOR_SIZE; sector++) {
+    long cluster = sector - SECTOR_OFFSET;
+    if (cluster > 1 && cluster < fat->size * 2 / 3 &&
+        fat_entry(fat->table, cluster) == 0) {
+      continue;
+    }
+    hash = hash_more(hash, image + sector * SECTOR_SIZE, SECTOR_SIZE);
+  }
+  return hash;
+}
+
+// writes the run header, followed by the sectors it covers out of image.
+void write_delta_run(FILE *out, byte *image, delta_run_t run) {
+  fwrite(&run, sizeof(delta_run_t), 1, out);
+  if (fwrite(image + run.sector * SECTOR_SIZE, SECTOR_SIZE, run.count, out) <
+      run.count) {
+    printf("Error writing delta run.\n");
+    exit(1);
+  }
+}
+
+/* Reads the next run out of the delta into run, and returns a buffer
+ * holding the run's sector data. The run is checked against the image size
+ * from the header before anything is allocated for it. */
+byte *read_delta_run(FILE *delta, delta_run_t *run, uint32_t image_size) {
+  if (fread(run, sizeof(delta_run_t), 1, delta) < 1) {
+    printf("Error: delta file is truncated.\n");
+    exit(1);
+  }
+  if (run->count == 0 || run->sector >= image_size / SECTOR_SIZE ||
+      run->count > image_size / SECTOR_SIZE - run->sector) {
+    printf("Error: delta run is outside the disk image.\n");
+    exit(1);
+  }
+  byte *data = malloc(run->count * SECTOR_SIZE * sizeof(byte));
+  if (fread(data, SECTOR_SIZE, run->count, delta) < run->count) {
+    printf("Error: delta file is truncated.\n");
+    exit(1);
+  }
+  return data;
+}
@@ -0,0 +1,34 @@
+/* Header file for delta.c, which reads and writes the binary delta
+ * files produced by diskdiff and applied by diskpatch. */
+#include "fat12.h"
+
+// version 2 changed the hashes to leave out free clusters.
+#define DELTA_MAGIC "FAT12DL2"
+
+/* A delta file is a delta_header_t followed by num_runs runs. Each run is a
+ * delta_run_t followed by count * SECTOR_SIZE bytes of sector data. Runs are
+ * sorted by sector, so applying them is one sequential pass over the image. */
+typedef struct delta_header_t {
+  char magic[8];
+  uint32_t image_size;
+  uint32_t num_runs;
+  // live_hash of the image before and after the patch.
+  uint64_t base_hash;
+  uint64_t target_hash;
+} delta_header_t;
+
+typedef struct delta_run_t {
+  uint32_t sector;
+  uint32_t count;
+} delta_run_t;
+
+void write_delta_header(FILE *out, delta_header_t header);
+delta_header_t read_delta_header(FILE *delta);
+
+/* Hashes every sector of the image except those of clusters that are free
+ * in its FAT. The delta leaves those out, so they can differ between the
+ * target and a patched image. */
+uint64_t live_hash(byte *image, long size, fat_table_t *fat);
+
+void write_delta_run(FILE *out, byte *image, delta_run_t run);
+byte *read_delta_run(FILE *delta, delta_run_t *run, uint32_t image_size);
@@ -0,0 +1,235 @@
+/* disk2tar streams a POSIX tar archive of everything in a disk image to
+ * stdout, keeping the modified times from the directory entries. Headers
+ * come from the image's index (built in memory if it doesn't have one), and
+ * files go into the archive in the order their data is on the disk, so the
+ * image is read from front to back in large reads with no temporary files. */
+#include "index.h"
+#include "stream.h"
+#include <limits.h>
+
+#define TAR_BLOCK 512
+// clusters read ahead at once from the data area.
+#define READ_AHEAD 256
+
+// ustar header, padded out to a block.
+typedef struct tar_header_t {
+  char name[100];
+  char mode[8];
+  char uid[8];
+  char gid[8];
+  char size[12];
+  char mtime[12];
+  char checksum[8];
+  char type;
+  char linkname[100];
+  char magic[6];
+  char version[2];
+  char uname[32];
+  char gname[32];
+  char devmajor[8];
+  char devminor[8];
+  char prefix[155];
+  char pad[12];
+} tar_header_t;
+
+// an entry of the index, and the first cluster of its data to sort by.
+typedef struct tar_entry_t {
+  int is_dir;
+  uint16_t start;
+  uint32_t entry;
+} tar_entry_t;
+
+typedef struct tar_t {
+  FILE *disk;
+  index_t index;
+  tar_entry_t *order;
+  int num_entries;
+  int next;      // the entry being written.
+  int started;   // whether its header has been written.
+  int extent;    // the extent being read, and clusters of it read so far.
+  int done;
+  int remaining; // bytes of its data left to write.
+  int end_blocks;
+  // clusters of the data area read ahead, from window_start.
+  byte *window;
+  int window_start, window_len, last_cluster;
+} tar_t;
+
+/* Files go first, by their first cluster, then directories in the reverse
+ * of the order of the index, so children come before their parents. That
+ * way extracting a directory's files and subdirectories doesn't change the
+ * modified time its header gives it. */
+int compare_entries(const void *a, const void *b) {
+  const tar_entry_t *x = a, *y = b;
+  if (x->is_dir != y->is_dir) {
+    return x->is_dir - y->is_dir;
+  } else if (x->is_dir) {
+    return (x->entry < y->entry) - (x->entry > y->entry);
+  }
+  return (x->start > y->start) - (x->start < y->start);
+}
+
+/* Puts the path in the name field, or if it is too long, splits it at a / so
+ * the name fits in 100 characters and what's before it in the prefix. */
+void set_path(tar_header_t *header, char *path) {
+  int len = strlen(path);
+  if (len <= 100) {
+    memcpy(header->name, path, len);
+    return;
+  }
+  for (char *split = strchr(path, '/'); split;
+       split = strchr(split + 1, '/')) {
+    int name_len = len - (split + 1 - path);
+    if (name_len <= 100 && split - path <= 155) {
+      memcpy(header->prefix, path, split - path);
+      memcpy(header->name, split + 1, name_len);
+      return;
+    }
+  }
+  fprintf(stderr, "Error: %s is too long for a tar header.\n", path);
+  exit(1);
+}
+
+void write_header(index_t *index, index_entry_t *entry, byte *block) {
+  tar_header_t *header = (tar_header_t *)block;
+  memset(header, 0, TAR_BLOCK);
+  directory_t dir = entry->dir;
+  int is_dir = dir.attribute & DIR_MASK, read_only = dir.attribute & 0x01;
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "%s%s", index->paths + entry->path,
+           is_dir ? "/" : "");
+  set_path(header, path);
+
+  // FAT times are local time, like mktime expects.
+  struct tm time =
+      bytes_to_time(dir.last_modified_time, dir.last_modified_date);
+  time.tm_isdst = -1;
+  int mode = (is_dir ? 0755 : 0644) & (read_only ? 0555 : 0777);
+  snprintf(header->mode, 8, "%07o", mode);
+  snprintf(header->uid, 8, "%07o", 0);
+  snprintf(header->gid, 8, "%07o", 0);
+  uint size = is_dir ? 0 : bytes_to_uint(dir.file_size);
+  snprintf(header->size, 12, "%011o", size);
+  snprintf(header->mtime, 12, "%011lo", (long)mktime(&time));
+  header->type = is_dir ? '5' : '0';
+  memcpy(header->magic, "ustar", 6);
+  memcpy(header->version, "00", 2);
+
+  // the checksum is taken with the checksum field as spaces.
+  memset(header->checksum, ' ', 8);
+  uint sum = 0;
+  for (int i = 0; i < TAR_BLOCK; i++) {
+    sum += block[i];
+  }
+  snprintf(header->checksum, 8, "%06o", sum);
+}
+
+/* Returns the data of the cluster, reading the next READ_AHEAD clusters
+ * from there if it isn't in the clusters already read. Since files are
+ * written in the order of their first clusters, a refill usually starts
+ * right where the last one ended. */
+byte *cluster_data(tar_t *tar, int cluster) {
+  if (cluster < tar->window_start ||
+      cluster >= tar->window_start + tar->window_len) {
+    tar->window_start = cluster;
+    tar->window_len = tar->last_cluster + 1 - cluster;
+    if (tar->window_len > READ_AHEAD) {
+      tar->window_len = READ_AHEAD;
+    }
+    read_req_t req = {.buf = tar->window,
+                      .offset = (long)(cluster + SECTOR_OFFSET) * SECTOR_SIZE,
+                      .len = tar->window_len * SECTOR_SIZE};
+    read_batch(tar->disk, &req, 1);
+  }
+  return tar->window + (cluster - tar->window_start) * SECTOR_SIZE;
+}
+
+/* Fills buf with the next blocks of the archive. Each cluster is one block,
+ * so a block of file data is a cluster, with the last one padded with
+ * zeros. The archive ends with two zero blocks. */
+int fill_tar(void *ctx, byte *buf, int cap) {
+  tar_t *tar = ctx;
+  int filled = 0;
+  for (; filled + TAR_BLOCK <= cap; filled += TAR_BLOCK) {
+    byte *block = buf + filled;
+    if (tar->next == tar->num_entries) {
+      if (tar->end_blocks == 2) {
+        break;
+      }
+      memset(block, 0, TAR_BLOCK);
+      tar->end_blocks++;
+      continue;
+    }
+    index_entry_t *entry = tar->index.entries + tar->order[tar->next].entry;
+    if (!tar->started) {
+      write_header(&tar->index, entry, block);
+      tar->started = 1;
+      tar->extent = tar->done = 0;
+      tar->remaining = (entry->dir.attribute & DIR_MASK)
+                           ? 0
+                           : bytes_to_uint(entry->dir.file_size);
+    } else {
+      index_extent_t extent =
+          tar->index.extents[entry->first_extent + tar->extent];
+      int len = (tar->remaining < TAR_BLOCK) ? tar->remaining : TAR_BLOCK;
+      memcpy(block, cluster_data(tar, extent.start + tar->done), len);
+      memset(block + len, 0, TAR_BLOCK - len);
+      tar->remaining -= len;
+      if (++tar->done == extent.count) {
+        tar->extent++;
+        tar->done = 0;
+      }
+    }
+    if (tar->remaining == 0) {
+      tar->next++;
+      tar->started = 0;
+    }
+  }
+  return filled;
+}
+
+void write_stdout(void *ctx, byte *buf, int len) {
+  if (fwrite(buf, 1, len, stdout) < len) {
+    fprintf(stderr, "Error writing archive.\n");
+    exit(1);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    printf("Usage: %s <IMAGE_NAME>.IMA > <ARCHIVE>.tar\n", argv[0]);
+    exit(1);
+  }
+  if (isatty(fileno(stdout))) {
+    fprintf(stderr, "Error: not writing the archive to a terminal.\n");
+    exit(1);
+  }
+  tar_t tar;
+  memset(&tar, 0, sizeof(tar_t));
+  tar.disk = open_disk(argv[1], "rb");
+  if (!load_index(tar.disk, argv[1], &tar.index)) {
+    memory_index(tar.disk, &tar.index);
+  }
+  index_header_t *header = tar.index.header;
+  tar.last_cluster = header->image_size / SECTOR_SIZE - SECTOR_OFFSET - 1;
+  tar.window = malloc(READ_AHEAD * SECTOR_SIZE * sizeof(byte));
+
+  tar.num_entries = header->num_entries;
+  tar.order = malloc(tar.num_entries * sizeof(tar_entry_t));
+  for (int i = 0; i < tar.num_entries; i++) {
+    index_entry_t *entry = tar.index.entries + i;
+    tar_entry_t item = {.is_dir = (entry->dir.attribute & DIR_MASK) != 0,
+                        .start = tar.index.extents[entry->first_extent].start,
+                        .entry = i};
+    tar.order[i] = item;
+  }
+  qsort(tar.order, tar.num_entries, sizeof(tar_entry_t), compare_entries);
+
+  double_buffer(fill_tar, &tar, write_stdout, NULL);
+  fflush(stdout);
+  free(tar.order);
+  free(tar.window);
+  close_index(&tar.index);
+  fclose(tar.disk);
+  return 0;
+}
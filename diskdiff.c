@@ -0,0 +1,227 @@
+/* Compares two FAT12 disk images structurally, printing which regions of the
+ * disk changed, which files were added, removed or changed, and how many data
+ * clusters differ. Optionally writes a binary delta of the changed sectors
+ * that diskpatch can apply to the base image to turn it into the target. */
+#include "delta.h"
+
+typedef struct file_entry_t {
+  char path[100];
+  directory_t dir;
+} file_entry_t;
+
+typedef struct file_list_t {
+  file_entry_t *files;
+  int size;
+  int capacity;
+} file_list_t;
+
+void add_file(file_list_t *list, char *path, directory_t dir) {
+  if (list->size == list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 64;
+    list->files = realloc(list->files, list->capacity * sizeof(file_entry_t));
+  }
+  file_entry_t *entry = list->files + list->size++;
+  strncpy(entry->path, path, 100);
+  entry->dir = dir;
+}
+
+/* Walks the directory tree, adding every file and subdirectory to list
+ * with its full path from the root directory. */
+void collect_files(FILE *disk, byte *fat_table, dir_list_t dirs, char *dirpath,
+                   file_list_t *list) {
+  for (int i = 0; i < dirs.size; i++) {
+    directory_t dir = dirs.dirs[i];
+    switch (should_skip_dir(dir)) {
+    case 1 ... 2:
+      continue;
+    case 3:
+      return;
+    default:
+      NULL;
+      char path[100];
+      char *filename = filename_ext(dir);
+      snprintf(path, 100, "%s%s%s", dirpath, *dirpath ? "/" : "", filename);
+      free(filename);
+      add_file(list, path, dir);
+      if (dir.attribute & DIR_MASK) {
+        ushort index = bytes_to_ushort(dir.first_cluster);
+        dir_list_t next_dirs = dir_from_fat(disk, fat_table, index);
+        collect_files(disk, fat_table, next_dirs, path, list);
+        free(next_dirs.dirs);
+      }
+    }
+  }
+}
+
+int compare_paths(const void *a, const void *b) {
+  return strcmp(((file_entry_t *)a)->path, ((file_entry_t *)b)->path);
+}
+
+file_list_t sorted_files(FILE *disk, fat12_t fat12) {
+  file_list_t list = {.files = NULL, .size = 0, .capacity = 0};
+  collect_files(disk, fat12.fat.table, fat12.root, "", &list);
+  qsort(list.files, list.size, sizeof(file_entry_t), compare_paths);
+  return list;
+}
+
+/* Data sectors whose cluster is free in both images are never compared,
+ * because their contents don't matter to either filesystem. A cluster free in
+ * the base but in use in the target always counts as changed, since the base
+ * hash leaves out free clusters and so says nothing about what they hold. */
+int sector_changed(byte *base, byte *target, fat12_t *base_fat,
+                   fat12_t *target_fat, int sector) {
+  if (sector > SECTOR_OFFSET + 1) {
+    int cluster = sector - SECTOR_OFFSET;
+    int base_free = fat_entry(base_fat->fat.table, cluster) == 0;
+    int target_free = fat_entry(target_fat->fat.table, cluster) == 0;
+    if (base_free && target_free) {
+      return 0;
+    } else if (base_free) {
+      return 1;
+    }
+  }
+  return memcmp(base + sector * SECTOR_SIZE, target + sector * SECTOR_SIZE,
+                SECTOR_SIZE) != 0;
+}
+
+int count_changed(byte *changed, int start, int end) {
+  int num = 0;
+  for (int i = start; i < end; i++) {
+    num += changed[i];
+  }
+  return num;
+}
+
+// checks the cluster chain of the file for any sector that changed.
+int chain_changed(byte *changed, byte *fat_table, int index, int num_sectors) {
+  for (int n = 0; index > 1 && index < LAST_SECTOR && n < num_sectors; n++) {
+    if (index + SECTOR_OFFSET < num_sectors && changed[index + SECTOR_OFFSET]) {
+      return 1;
+    }
+    index = fat_entry(fat_table, index);
+  }
+  return 0;
+}
+
+/* Merges the two sorted file lists, printing + for files only in the target,
+ * - for files only in the base, and ~ for files whose directory entry or
+ * data clusters changed. */
+void print_file_changes(file_list_t base, file_list_t target, byte *changed,
+                        fat12_t target_fat) {
+  int i = 0, j = 0;
+  while (i < base.size || j < target.size) {
+    int cmp = (i == base.size)     ? 1
+              : (j == target.size) ? -1
+                                   : strcmp(base.files[i].path,
+                                            target.files[j].path);
+    if (cmp < 0) {
+      printf("- %s\n", base.files[i++].path);
+    } else if (cmp > 0) {
+      printf("+ %s\n", target.files[j++].path);
+    } else {
+      directory_t dir = target.files[j].dir;
+      int entry_changed =
+          memcmp(&base.files[i].dir, &dir, sizeof(directory_t)) != 0;
+      int data_changed =
+          !(dir.attribute & DIR_MASK) &&
+          chain_changed(changed, target_fat.fat.table,
+                        bytes_to_ushort(dir.first_cluster),
+                        target_fat.num_sectors);
+      if (entry_changed || data_changed) {
+        printf("~ %s\n", target.files[j].path);
+      }
+      i++;
+      j++;
+    }
+  }
+}
+
+/* Writes each run of consecutive changed sectors out of the target image,
+ * in sector order, so diskpatch can apply them in one sequential pass. */
+void write_delta(char *filename, byte *target, byte *changed, int num_sectors,
+                 delta_header_t header) {
+  FILE *out = fopen(filename, "wb");
+  if (out == NULL) {
+    printf("Error: could not create %s.\n", filename);
+    exit(1);
+  }
+  header.num_runs = 0;
+  for (int i = 0; i < num_sectors; i++) {
+    header.num_runs += changed[i] && (i == 0 || !changed[i - 1]);
+  }
+  write_delta_header(out, header);
+  int num_changed = 0;
+  for (int i = 0; i < num_sectors; i++) {
+    if (!changed[i]) {
+      continue;
+    }
+    delta_run_t run = {.sector = i, .count = 0};
+    while (i + run.count < num_sectors && changed[i + run.count]) {
+      run.count++;
+    }
+    write_delta_run(out, target, run);
+    num_changed += run.count;
+    i += run.count;
+  }
+  fclose(out);
+  printf("Wrote %d sectors in %d runs to %s.\n", num_changed, header.num_runs,
+         filename);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    printf("Usage: %s <BASE>.IMA <TARGET>.IMA [<DELTA>]\n", argv[0]);
+    exit(1);
+  }
+  FILE *base_disk = open_disk(argv[1], "rb");
+  FILE *target_disk = open_disk(argv[2], "rb");
+  long base_size, target_size;
+  byte *base = map_disk(base_disk, &base_size);
+  byte *target = map_disk(target_disk, &target_size);
+  if (base_size != target_size) {
+    printf("Error: images are different sizes.\n");
+    exit(1);
+  }
+
+  fat12_t base_fat = fat12_from_file(base_disk);
+  fat12_t target_fat = fat12_from_file(target_disk);
+  int num_sectors = base_size / SECTOR_SIZE;
+
+  byte *changed = calloc(num_sectors, sizeof(byte));
+  for (int i = 0; i < num_sectors; i++) {
+    changed[i] = sector_changed(base, target, &base_fat, &target_fat, i);
+  }
+
+  int fat_end = base_fat.fat.start + base_fat.boot_sector[16] *
+                                         bytes_to_ushort(base_fat.boot_sector + 22);
+  printf("Boot sector: %s\n", changed[0] ? "changed" : "unchanged");
+  printf("FAT: %d sectors changed\n",
+         count_changed(changed, base_fat.fat.start, fat_end));
+  printf("Root directory: %d sectors changed\n",
+         count_changed(changed, ROOT, SECTOR_OFFSET + 2));
+  printf("Data: %d clusters changed\n",
+         count_changed(changed, SECTOR_OFFSET + 2, num_sectors));
+
+  file_list_t base_files = sorted_files(base_disk, base_fat);
+  file_list_t target_files = sorted_files(target_disk, target_fat);
+  print_file_changes(base_files, target_files, changed, target_fat);
+
+  if (argc > 3) {
+    delta_header_t header = {.image_size = base_size,
+                             .base_hash =
+                                 live_hash(base, base_size, &base_fat.fat),
+                             .target_hash = live_hash(target, target_size,
+                                                      &target_fat.fat)};
+    write_delta(argv[3], target, changed, num_sectors, header);
+  }
+
+  free(base_files.files);
+  free(target_files.files);
+  free(changed);
+  free_fat12(base_fat);
+  free_fat12(target_fat);
+  munmap(base, base_size);
+  munmap(target, target_size);
+  fclose(base_disk);
+  fclose(target_disk);
+}
@@ -0,0 +1,279 @@
+/* Searches the directory trees of one or more FAT12 disk images for entries
+ * matching a set of predicates, printing IMAGE:PATH for every match.
+ * Predicates are checked against the raw directory entry fields, so no names
+ * or timestamps are decoded for entries that don't match. */
+#include "fat12.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <limits.h>
+
+typedef struct query_t {
+  char *name;    // glob matched against NAME.EXT, NULL for any name.
+  char **prune;  // globs of directory paths not to descend into.
+  int num_prune;
+  int size_op;   // -1: smaller than, 0: exactly, 1: larger than size.
+  int has_size;
+  uint size;
+  // packed FAT date/time stamps, (date << 16) | time. 0 when unset.
+  uint after;
+  uint before;
+  char type;     // 'f' for files, 'd' for directories, 0 for either.
+  int limit;     // stop after this many matches, 0 for no limit.
+  int found;
+} query_t;
+
+int trimmed_len(byte *bytes, int max) {
+  int len = 0;
+  while (len < max && bytes[len] != 0x20) {
+    len++;
+  }
+  return len;
+}
+
+// the character at i in the NAME.EXT form of the entry's name.
+char name_char(directory_t *dir, int i, int name_len) {
+  if (i < name_len) {
+    return dir->filename[i];
+  }
+  return (i == name_len) ? '.' : dir->extension[i - name_len - 1];
+}
+
+/* Matches a glob supporting * and ? against the entry's name, reading the
+ * filename and extension fields in place instead of joining them. */
+int match_name(char *pat, directory_t *dir, int i, int name_len, int len) {
+  for (; *pat; pat++, i++) {
+    if (*pat == '*') {
+      for (int j = i; j <= len; j++) {
+        if (match_name(pat + 1, dir, j, name_len, len)) {
+          return 1;
+        }
+      }
+      return 0;
+    }
+    if (i >= len || (*pat != '?' && *pat != name_char(dir, i, name_len))) {
+      return 0;
+    }
+  }
+  return i == len;
+}
+
+uint entry_stamp(directory_t *dir) {
+  return (bytes_to_ushort(dir->last_modified_date) << 16) |
+         bytes_to_ushort(dir->last_modified_time);
+}
+
+int matches(directory_t *dir, query_t *q) {
+  int is_dir = dir->attribute & DIR_MASK;
+  if ((q->type == 'f' && is_dir) || (q->type == 'd' && !is_dir)) {
+    return 0;
+  }
+  if (q->has_size) {
+    uint size = bytes_to_uint(dir->file_size);
+    if ((q->size_op < 0 && size >= q->size) ||
+        (q->size_op > 0 && size <= q->size) ||
+        (q->size_op == 0 && size != q->size)) {
+      return 0;
+    }
+  }
+  if ((q->after && entry_stamp(dir) < q->after) ||
+      (q->before && entry_stamp(dir) >= q->before)) {
+    return 0;
+  }
+  if (q->name) {
+    int name_len = trimmed_len(dir->filename, 8);
+    int ext_len = trimmed_len(dir->extension, 3);
+    int len = name_len + (ext_len ? ext_len + 1 : 0);
+    return match_name(q->name, dir, 0, name_len, len);
+  }
+  return 1;
+}
+
+int pruned(char *path, query_t *q) {
+  for (int i = 0; i < q->num_prune; i++) {
+    if (fnmatch(q->prune[i], path, 0) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int done(query_t *q) { return q->limit && q->found >= q->limit; }
+
+void search_dir(FILE *disk, fat12_t *fat12, int index, char *image,
+                char *dirpath, query_t *q);
+
+/* Checks the num_entries directory entries in buf against the query,
+ * descending into subdirectories as they are found. Returns 1 once the
+ * end of the directory has been reached. */
+int search_entries(FILE *disk, fat12_t *fat12, byte *buf, int num_entries,
+                   char *image, char *dirpath, query_t *q) {
+  for (int i = 0; i < num_entries && !done(q); i++) {
+    directory_t *dir = (directory_t *)(buf + i * DIR_SIZE);
+    switch (should_skip_dir(*dir)) {
+    case 1 ... 2:
+      continue;
+    case 3:
+      return 1;
+    default:
+      if (matches(dir, q)) {
+        int name_len = trimmed_len(dir->filename, 8);
+        int ext_len = trimmed_len(dir->extension, 3);
+        printf("%s:%s%.*s%s%.*s\n", image, dirpath, name_len, dir->filename,
+               ext_len ? "." : "", ext_len, dir->extension);
+        q->found++;
+      }
+      if (dir->attribute & DIR_MASK) {
+        char path[PATH_MAX];
+        int len = snprintf(path, PATH_MAX, "%s%.*s", dirpath,
+                           trimmed_len(dir->filename, 8), dir->filename);
+        // leaves room for the / added below.
+        if (len >= PATH_MAX - 1) {
+          printf("Error: directory path too long: %s\n", path);
+          exit(1);
+        }
+        if (!pruned(path, q)) {
+          path[len] = '/';
+          path[len + 1] = '\0';
+          search_dir(disk, fat12, bytes_to_ushort(dir->first_cluster), image,
+                     path, q);
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+// searches the directory one sector at a time along its cluster chain.
+void search_dir(FILE *disk, fat12_t *fat12, int index, char *image,
+                char *dirpath, query_t *q) {
+  while (!done(q)) {
+    byte *sector = read_sector(disk, index + SECTOR_OFFSET);
+    int end = search_entries(disk, fat12, sector, DIRS_PER_SECTOR, image,
+                             dirpath, q);
+    free(sector);
+    index = fat_entry(fat12->fat.table, index);
+    if (end || last_sector(index, "search_dir")) {
+      return;
+    }
+  }
+}
+
+// parses YYYY-MM-DD into a packed FAT stamp for midnight on that day.
+uint parse_date(char *date) {
+  int year, month, day;
+  int days[] = {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+  // FAT dates run from 1980 to 2107.
+  if (sscanf(date, "%d-%d-%d", &year, &month, &day) != 3 || year < 1980 ||
+      year > 2107 || month < 1 || month > 12 || day < 1 ||
+      day > days[month - 1] ||
+      (month == 2 && day == 29 && (year % 4 != 0 || year == 2100))) {
+    printf("Error: invalid date %s, expected YYYY-MM-DD.\n", date);
+    exit(1);
+  }
+  return (uint)(((year - 1980) << 9) | (month << 5) | day) << 16;
+}
+
+/* Parses the digits at the start of str as a number no bigger than max,
+ * setting end to the first character after them. Exits if there are no
+ * digits or the number is too big. */
+unsigned long parse_number(char *str, char **end, unsigned long max,
+                           char *arg) {
+  errno = 0;
+  unsigned long num = isdigit(*str) ? strtoul(str, end, 10) : 0;
+  if (!isdigit(*str) || errno == ERANGE || num > max) {
+    printf("Error: invalid number %s.\n", arg);
+    exit(1);
+  }
+  return num;
+}
+
+void parse_size(char *arg, query_t *q) {
+  char *end;
+  q->has_size = 1;
+  q->size_op = (*arg == '+') ? 1 : (*arg == '-') ? -1 : 0;
+  q->size = parse_number(arg + (q->size_op != 0), &end, UINT_MAX, arg);
+  if ((*end == 'k' || *end == 'K') && q->size <= UINT_MAX / 1024) {
+    q->size *= 1024;
+    end++;
+  }
+  if (*end != '\0') {
+    printf("Error: invalid size %s, expected [+-]N[k].\n", arg);
+    exit(1);
+  }
+}
+
+int parse_limit(char *arg) {
+  char *end;
+  int limit = parse_number(arg, &end, INT_MAX, arg);
+  if (*end != '\0') {
+    printf("Error: invalid number %s.\n", arg);
+    exit(1);
+  }
+  return limit;
+}
+
+char *upper(char *str) {
+  for (int i = 0; str[i]; i++) {
+    str[i] = toupper(str[i]);
+  }
+  return str;
+}
+
+int main(int argc, char *argv[]) {
+  query_t q = {.prune = malloc(argc * sizeof(char *))};
+  char **images = malloc(argc * sizeof(char *));
+  int num_images = 0;
+  for (int i = 1; i < argc; i++) {
+    char *arg = argv[i];
+    if (arg[0] != '-') {
+      images[num_images++] = arg;
+    } else if (strcmp(arg, "-quit") == 0) {
+      q.limit = 1;
+    } else if (i + 1 == argc) {
+      printf("Error: %s needs an argument.\n", arg);
+      exit(1);
+    } else if (strcmp(arg, "-name") == 0) {
+      q.name = upper(argv[++i]);
+    } else if (strcmp(arg, "-size") == 0) {
+      parse_size(argv[++i], &q);
+    } else if (strcmp(arg, "-after") == 0) {
+      q.after = parse_date(argv[++i]);
+    } else if (strcmp(arg, "-before") == 0) {
+      q.before = parse_date(argv[++i]);
+    } else if (strcmp(arg, "-type") == 0) {
+      char *type = argv[++i];
+      if (strcmp(type, "f") != 0 && strcmp(type, "d") != 0) {
+        printf("Error: invalid type %s, expected f or d.\n", type);
+        exit(1);
+      }
+      q.type = type[0];
+    } else if (strcmp(arg, "-prune") == 0) {
+      q.prune[q.num_prune++] = upper(argv[++i]);
+    } else if (strcmp(arg, "--limit") == 0) {
+      q.limit = parse_limit(argv[++i]);
+    } else {
+      printf("Error: unknown predicate %s.\n", arg);
+      exit(1);
+    }
+  }
+  if (num_images == 0) {
+    printf("Usage: %s <IMAGE_NAME>.IMA... [-name GLOB] [-size [+-]N[k]] "
+           "[-after DATE] [-before DATE] [-type f|d] [-prune PATH] "
+           "[-quit] [--limit N]\n",
+           argv[0]);
+    exit(1);
+  }
+
+  for (int i = 0; i < num_images && !done(&q); i++) {
+    FILE *disk = open_disk(images[i], "rb");
+    fat12_t fat12 = fat12_from_file(disk);
+    search_entries(disk, &fat12, (byte *)fat12.root.dirs, fat12.root.size,
+                   images[i], "", &q);
+    free_fat12(fat12);
+    fclose(disk);
+  }
+  free(images);
+  free(q.prune);
+  return q.found == 0;
+}
@@ -0,0 +1,250 @@
+/* Creates blank FAT12 disk images. Writes the boot sector, the FAT copies and
+ * an empty root directory, and leaves the data area as a hole in the file so
+ * nothing is written for it. With --count, many images are stamped out of one
+ * in-memory template, cloned with a reflink where the host filesystem can. */
+#include "fat12.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+
+typedef struct geometry_t {
+  int size_kb;
+  int num_sectors;
+  int sectors_per_cluster;
+  int root_entries;
+  int media;
+  int sectors_per_fat;
+  int sectors_per_track;
+  int heads;
+} geometry_t;
+
+// the standard floppy geometries, by size in KB.
+geometry_t geometries[] = {
+    {160, 320, 1, 64, 0xFE, 1, 8, 1},    {180, 360, 1, 64, 0xFC, 2, 9, 1},
+    {320, 640, 2, 112, 0xFF, 1, 8, 2},   {360, 720, 2, 112, 0xFD, 2, 9, 2},
+    {720, 1440, 2, 112, 0xF9, 3, 9, 2},  {1200, 2400, 1, 224, 0xF9, 7, 15, 2},
+    {1440, 2880, 1, 224, 0xF0, 9, 18, 2}, {2880, 5760, 2, 240, 0xF0, 9, 36, 2}};
+
+#define NUM_GEOMETRIES 8
+#define NUM_FATS 2
+// FAT12 can't address this many clusters.
+#define MAX_CLUSTERS 4085
+
+geometry_t find_geometry(int size_kb) {
+  for (int i = 0; i < NUM_GEOMETRIES; i++) {
+    if (geometries[i].size_kb == size_kb) {
+      return geometries[i];
+    }
+  }
+  printf("Error: no standard %dKB geometry.\n", size_kb);
+  exit(1);
+}
+
+int root_sectors(geometry_t geom) {
+  return (geom.root_entries * DIR_SIZE + SECTOR_SIZE - 1) / SECTOR_SIZE;
+}
+
+/* Finds the smallest FAT that can hold an entry for every cluster left over
+ * once the FATs themselves take their space. */
+int fat_sectors(geometry_t geom) {
+  int sectors_per_fat = 1;
+  while (1) {
+    int data_sectors =
+        geom.num_sectors - 1 - NUM_FATS * sectors_per_fat - root_sectors(geom);
+    int clusters = data_sectors / geom.sectors_per_cluster + 2;
+    int needed = (clusters * 3 / 2 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    if (needed <= sectors_per_fat) {
+      return sectors_per_fat;
+    }
+    sectors_per_fat = needed;
+  }
+}
+
+void put_ushort(byte *bytes, ushort value) {
+  bytes[0] = value & 0xFF;
+  bytes[1] = value >> 8;
+}
+
+void put_name(byte *bytes, char *name, int len) {
+  memset(bytes, 0x20, len);
+  for (int i = 0; name[i] && i < len; i++) {
+    bytes[i] = toupper(name[i]);
+  }
+}
+
+/* Builds the metadata region of the image, the boot sector, FAT copies and
+ * root directory, as one buffer. Sets size to its length in bytes. */
+byte *build_template(geometry_t geom, char *label, char *oem, int *size) {
+  int meta_sectors = 1 + NUM_FATS * geom.sectors_per_fat + root_sectors(geom);
+  *size = meta_sectors * SECTOR_SIZE;
+  byte *meta = calloc(*size, sizeof(byte));
+
+  byte *boot_sector = meta;
+  memcpy(boot_sector, "\xEB\x3C\x90", 3);
+  put_name(boot_sector + 3, oem, 8);
+  put_ushort(boot_sector + 11, SECTOR_SIZE);
+  boot_sector[13] = geom.sectors_per_cluster;
+  put_ushort(boot_sector + 14, 1);
+  boot_sector[16] = NUM_FATS;
+  put_ushort(boot_sector + 17, geom.root_entries);
+  put_ushort(boot_sector + 19, geom.num_sectors);
+  boot_sector[21] = geom.media;
+  put_ushort(boot_sector + 22, geom.sectors_per_fat);
+  put_ushort(boot_sector + 24, geom.sectors_per_track);
+  put_ushort(boot_sector + 26, geom.heads);
+  // extended boot record: signature, volume id, label and filesystem type.
+  boot_sector[38] = 0x29;
+  uint volume_id = time(NULL);
+  memcpy(boot_sector + 39, &volume_id, 4);
+  put_name(boot_sector + 43, label ? label : "NO NAME", 11);
+  memcpy(boot_sector + 54, "FAT12   ", 8);
+  // the boot code just halts, these images aren't bootable.
+  memcpy(boot_sector + 62, "\xFA\xF4\xEB\xFD", 4);
+  boot_sector[510] = 0x55;
+  boot_sector[511] = 0xAA;
+
+  // the first two FAT entries hold the media descriptor and an end marker.
+  for (int i = 0; i < NUM_FATS; i++) {
+    byte *fat = meta + (1 + i * geom.sectors_per_fat) * SECTOR_SIZE;
+    fat[0] = geom.media;
+    fat[1] = 0xFF;
+    fat[2] = 0xFF;
+  }
+
+  if (label) {
+    directory_t *root =
+        (directory_t *)(meta + (1 + NUM_FATS * geom.sectors_per_fat) *
+                                   SECTOR_SIZE);
+    put_name(root->filename, label, 11);
+    root->attribute = LABEL_MASK;
+  }
+  return meta;
+}
+
+/* Writes the template to a new image and extends it to its full size without
+ * writing the data area, so the rest of the file is a hole. */
+int write_image(char *filename, byte *meta, int meta_size, long image_size) {
+  // read as well as write, the fd is the source when cloning the image.
+  int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || pwrite(fd, meta, meta_size, 0) < meta_size ||
+      ftruncate(fd, image_size) < 0) {
+    printf("Error: could not write %s.\n", filename);
+    exit(1);
+  }
+  return fd;
+}
+
+// clones the first image into filename, falling back to writing the template.
+void clone_image(int src_fd, char *filename, byte *meta, int meta_size,
+                 long image_size) {
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd >= 0 && ioctl(fd, FICLONE, src_fd) == 0) {
+    close(fd);
+    return;
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  close(write_image(filename, meta, meta_size, image_size));
+}
+
+// names the nth of many images by adding _n before the extension.
+void numbered_name(char *buf, int len, char *filename, int n) {
+  char *ext = strrchr(filename, '.');
+  int base_len = ext ? ext - filename : strlen(filename);
+  snprintf(buf, len, "%.*s_%d%s", base_len, filename, n, ext ? ext : "");
+}
+
+int main(int argc, char *argv[]) {
+  geometry_t geom = find_geometry(1440);
+  char *label = NULL, *oem = "MSDOS5.0", *filename = NULL;
+  int count = 0, custom = 0;
+  for (int i = 1; i < argc; i++) {
+    char *arg = argv[i];
+    if (arg[0] != '-') {
+      filename = arg;
+    } else if (i + 1 == argc) {
+      printf("Error: %s needs an argument.\n", arg);
+      exit(1);
+    } else if (strcmp(arg, "--size") == 0) {
+      geom = find_geometry(atoi(argv[++i]));
+    } else if (strcmp(arg, "--sectors") == 0) {
+      geom.num_sectors = atoi(argv[++i]);
+      // the boot sector's 16-bit total, other tools don't read the 32-bit one.
+      if (geom.num_sectors <= 0 || geom.num_sectors > 65535) {
+        printf("Error: --sectors must be from 1 to 65535.\n");
+        exit(1);
+      }
+      custom = 1;
+    } else if (strcmp(arg, "--cluster-sectors") == 0) {
+      geom.sectors_per_cluster = atoi(argv[++i]);
+      int spc = geom.sectors_per_cluster;
+      if (spc < 1 || spc > 128 || (spc & (spc - 1)) != 0) {
+        printf("Error: --cluster-sectors must be a power of two up to 128.\n");
+        exit(1);
+      }
+      custom = 1;
+    } else if (strcmp(arg, "--root-entries") == 0) {
+      geom.root_entries = atoi(argv[++i]);
+      // rounded up to fill a sector, it still has to fit in 16 bits.
+      int max_entries = 0xFFFF / DIRS_PER_SECTOR * DIRS_PER_SECTOR;
+      if (geom.root_entries <= 0 || geom.root_entries > max_entries) {
+        printf("Error: --root-entries must be from 1 to %d.\n", max_entries);
+        exit(1);
+      }
+      custom = 1;
+    } else if (strcmp(arg, "--label") == 0) {
+      label = argv[++i];
+    } else if (strcmp(arg, "--oem") == 0) {
+      oem = argv[++i];
+    } else if (strcmp(arg, "--count") == 0) {
+      count = atoi(argv[++i]);
+      if (count < 0) {
+        printf("Error: --count can't be negative.\n");
+        exit(1);
+      }
+    } else {
+      printf("Error: unknown option %s.\n", arg);
+      exit(1);
+    }
+  }
+  if (filename == NULL) {
+    printf("Usage: %s [--size KB] [--sectors N] [--cluster-sectors N] "
+           "[--root-entries N] [--label LABEL] [--oem NAME] [--count N] "
+           "<IMAGE_NAME>.IMA\n",
+           argv[0]);
+    exit(1);
+  }
+  if (custom) {
+    // round the root directory up to fill its last sector.
+    geom.root_entries = root_sectors(geom) * DIRS_PER_SECTOR;
+    geom.sectors_per_fat = fat_sectors(geom);
+  }
+  int data_sectors = geom.num_sectors - 1 -
+                     NUM_FATS * geom.sectors_per_fat - root_sectors(geom);
+  if (data_sectors <= 0 ||
+      data_sectors / geom.sectors_per_cluster >= MAX_CLUSTERS) {
+    printf("Error: geometry does not fit a FAT12 filesystem.\n");
+    exit(1);
+  }
+
+  int meta_size;
+  byte *meta = build_template(geom, label, oem, &meta_size);
+  long image_size = (long)geom.num_sectors * SECTOR_SIZE;
+  if (count == 0) {
+    close(write_image(filename, meta, meta_size, image_size));
+    printf("Formatted %s (%ld bytes).\n", filename, image_size);
+  } else {
+    char name[256];
+    numbered_name(name, 256, filename, 1);
+    int first_fd = write_image(name, meta, meta_size, image_size);
+    for (int i = 2; i <= count; i++) {
+      numbered_name(name, 256, filename, i);
+      clone_image(first_fd, name, meta, meta_size, image_size);
+    }
+    close(first_fd);
+    printf("Formatted %d images (%ld bytes each).\n", count, image_size);
+  }
+  free(meta);
+}
@@ -1,30 +1,147 @@
 /* Diskget fetches a file out of the root directory of the disk image
- * into the current directory. (Error if file not found in root dir) */
-#include "fat12.h"
+ * into the current directory. (Error if file not found in root dir)
+ * With -o, the file is written to the given path instead, and -o -
+ * streams it to stdout. If the image has an index, the file is found and
+ * read using the index instead of the root directory and FAT. */
+#include "index.h"
+#include "stream.h"
 #include <ctype.h>
 
+typedef struct chain_reader_t {
+  FILE *disk;
+  byte *fat_table;
+  int index;
+  int remaining;
+} chain_reader_t;
+
+/* Reads the next part of the file along its cluster chain into buf, up to cap
+ * bytes. The clusters are read ahead in one batch, with a read in flight for
+ * each run of consecutive clusters. */
+int read_chain(void *ctx, byte *buf, int cap) {
+  chain_reader_t *chain = ctx;
+  if (chain->remaining <= 0 || chain->index >= LAST_SECTOR) {
+    return 0;
+  }
+  int count = (chain->remaining + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  if (count > cap / SECTOR_SIZE) {
+    count = cap / SECTOR_SIZE;
+  }
+  read_req_t reqs[count];
+  int num_reqs = chain_reads(chain->fat_table, &chain->index, count, buf, reqs);
+  read_batch(chain->disk, reqs, num_reqs);
+  int len = (count * SECTOR_SIZE < chain->remaining) ? count * SECTOR_SIZE
+                                                     : chain->remaining;
+  chain->remaining -= len;
+  return len;
+}
+
+typedef struct extent_reader_t {
+  FILE *disk;
+  index_extent_t *extents;
+  int num_extents;
+  int next;      // the extent being read.
+  int done;      // clusters of that extent already read.
+  int remaining;
+} extent_reader_t;
+
+// like read_chain, but follows the file's extents from the index.
+int read_extents(void *ctx, byte *buf, int cap) {
+  extent_reader_t *file = ctx;
+  int count = (file->remaining + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  if (count > cap / SECTOR_SIZE) {
+    count = cap / SECTOR_SIZE;
+  }
+  read_req_t reqs[count];
+  int num_reqs = 0, filled = 0;
+  while (filled < count && file->next < file->num_extents) {
+    index_extent_t extent = file->extents[file->next];
+    int take = extent.count - file->done;
+    take = (take < count - filled) ? take : count - filled;
+    read_req_t req = {
+        .buf = buf + filled * SECTOR_SIZE,
+        .offset = (long)(extent.start + file->done + SECTOR_OFFSET) *
+                  SECTOR_SIZE,
+        .len = take * SECTOR_SIZE};
+    reqs[num_reqs++] = req;
+    filled += take;
+    file->done += take;
+    if (file->done == extent.count) {
+      file->next++;
+      file->done = 0;
+    }
+  }
+  read_batch(file->disk, reqs, num_reqs);
+  int len = (filled * SECTOR_SIZE < file->remaining) ? filled * SECTOR_SIZE
+                                                     : file->remaining;
+  file->remaining -= len;
+  return len;
+}
+
+void write_out(void *ctx, byte *buf, int len) {
+  if (fwrite(buf, 1, len, (FILE *)ctx) < len) {
+    fprintf(stderr, "Error writing file.\n");
+    exit(1);
+  }
+}
+
 /* Copies the file starting at the sector in the FAT-12
  * filesystem in src_disk corresponding to index into the out file
- * on the host filesystem. */
+ * on the host filesystem. Reading from the disk image is done on
+ * another thread, so it overlaps with writing out the file. */
 void copy_file(FILE *src, FILE *out, byte *fat_table, int index, int size) {
-  ushort next_index = fat_entry(fat_table, index);
-  byte *sector = read_sector(src, index + SECTOR_OFFSET);
-
-  if (last_sector(next_index, "copy_file")) {
-    fwrite(sector, size, 1, out);
-  } else {
-    fwrite(sector, SECTOR_SIZE, 1, out);
-    copy_file(src, out, fat_table, next_index, size - SECTOR_SIZE);
-  }
-  free(sector);
+  chain_reader_t chain = {
+      .disk = src, .fat_table = fat_table, .index = index, .remaining = size};
+  double_buffer(read_chain, &chain, write_out, out);
 }
 
 int main(int argc, char *argv[]) {
-  FILE *disk = open_disk(argv[1], "rb");
-  char *target = argv[2];
+  char *out_path = NULL;
+  char *args[2];
+  int num_args = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      out_path = argv[++i];
+    } else if (num_args < 2) {
+      args[num_args++] = argv[i];
+    }
+  }
+  if (num_args < 2) {
+    printf("Usage: %s <IMAGE_NAME>.IMA <FILE> [-o <PATH>|-]\n", argv[0]);
+    exit(1);
+  }
+  FILE *disk = open_disk(args[0], "rb");
+  char *target = args[1];
   for (int i = 0; target[i]; i++) {
     target[i] = toupper(target[i]);
   }
+  int to_stdout = out_path && strcmp(out_path, "-") == 0;
+  // messages go to stderr when the file itself is going to stdout.
+  FILE *msg = to_stdout ? stderr : stdout;
+  index_t index;
+  if (load_index(disk, args[0], &index)) {
+    index_entry_t *entry = index_find(&index, index.dirs, target);
+    if (entry == NULL) {
+      fprintf(msg, "%s not found in root directory.\n", target);
+      exit(1);
+    }
+    char *dest_name = out_path ? out_path : target;
+    FILE *dest = to_stdout ? stdout : fopen(dest_name, "wb");
+    if (dest == NULL) {
+      fprintf(msg, "Error: could not create %s.\n", dest_name);
+      exit(1);
+    }
+    extent_reader_t file = {.disk = disk,
+                            .extents = index.extents + entry->first_extent,
+                            .num_extents = entry->num_extents,
+                            .remaining = bytes_to_uint(entry->dir.file_size)};
+    double_buffer(read_extents, &file, write_out, dest);
+    fclose(dest);
+    close_index(&index);
+    fclose(disk);
+    fprintf(msg, "File %s copied to %s.\n", target,
+            to_stdout ? "stdout" : out_path ? out_path : "current directory");
+    exit(0);
+  }
   fat12_t fat12 = fat12_from_file(disk);
   for (int i = 0; i < fat12.root.size; i++) {
     directory_t dir = fat12.root.dirs[i];
@@ -32,25 +149,35 @@ int main(int argc, char *argv[]) {
     case 1 ... 2:
       continue;
     case 3:
-      printf("%s not found in root directory.\n", target);
+      fprintf(msg, "%s not found in root directory.\n", target);
       exit(1);
     default:
       NULL; // My linter complains if I don't have a statement here
       char *filename = filename_ext(dir);
       if (strcmp(filename, target) == 0) {
         ushort index = bytes_to_ushort(dir.first_cluster);
-        FILE *dest = fopen(filename, "wb");
+        char *dest_name = out_path ? out_path : filename;
+        FILE *dest = to_stdout ? stdout : fopen(dest_name, "wb");
+        if (dest == NULL) {
+          fprintf(msg, "Error: could not create %s.\n", dest_name);
+          exit(1);
+        }
         copy_file(disk, dest, fat12.fat.table, index,
                   bytes_to_uint(dir.file_size));
         fclose(dest);
         fclose(disk);
         free_fat12(fat12);
-        printf("File %s copied to current directory.\n", target);
+        if (out_path) {
+          fprintf(msg, "File %s copied to %s.\n", target,
+                  to_stdout ? "stdout" : out_path);
+        } else {
+          printf("File %s copied to current directory.\n", target);
+        }
         exit(0);
       }
     }
   }
-  printf("%s not found in root directory.\n", target);
+  fprintf(msg, "%s not found in root directory.\n", target);
   fclose(disk);
   free_fat12(fat12);
   exit(1);
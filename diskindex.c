@@ -0,0 +1,24 @@
+/* Builds (or rebuilds) the sidecar index of each disk image given. Once an
+ * image has an index, diskinfo, disklist and diskget read from it, and
+ * diskput keeps it up to date. */
+#include "index.h"
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    printf("Usage: %s <IMAGE_NAME>.IMA...\n", argv[0]);
+    exit(1);
+  }
+  for (int i = 1; i < argc; i++) {
+    FILE *disk = open_disk(argv[i], "rb");
+    build_index(disk, argv[i]);
+    index_t index;
+    if (!load_index(disk, argv[i], &index)) {
+      printf("Error: could not read back index of %s.\n", argv[i]);
+      exit(1);
+    }
+    printf("Indexed %s: %d files in %d directories.\n", argv[i],
+           index.header->num_files, index.header->num_dirs);
+    close_index(&index);
+    fclose(disk);
+  }
+}
@@ -1,52 +1,132 @@
 /* Prints information about the FAT12 file system on a disk image. Information
  * includes the OS name, disk label, total disk size, FAT table size, free
- * space, number of files, FAT copies, and sectors per FAT. */
-#include "fat12.h"
+ * space, number of files, FAT copies, and sectors per FAT.
+ *
+ * --fields picks which of these to print, and only the parts of the disk
+ * needed for them are read: the boot sector always, the FAT only for free
+ * space and the file count, and the directory tree only for the file count
+ * (or the label, if the boot sector doesn't have one). If the image has an
+ * index, free space and the file count come from it instead. */
+#include "index.h"
 
-void print_disk_label(dir_list_t root) {
-  // buf is the buffer containing the root directory
-  for (int i = 0; i < root.size; i++) {
-    directory_t dir = root.dirs[i];
-    int skip = should_skip_dir(dir);
-    if (skip == 3) {
-      break;
-    } else if (skip == 1) {
-      printf("Disk Label: %8.8s\n", dir.filename);
+#define FIELD_OS 0x01
+#define FIELD_LABEL 0x02
+#define FIELD_SIZE 0x04
+#define FIELD_FAT_SIZE 0x08
+#define FIELD_FREE 0x10
+#define FIELD_FILES 0x20
+#define FIELD_FAT_COPIES 0x40
+#define FIELD_SECTORS_PER_FAT 0x80
+#define ALL_FIELDS 0xFF
+
+char *field_names[] = {"os",   "label", "size",       "fat_size",
+                       "free", "files", "fat_copies", "sectors_per_fat"};
+
+int parse_fields(char *list) {
+  int fields = 0;
+  for (char *name = strtok(list, ","); name; name = strtok(NULL, ",")) {
+    int i = 0;
+    while (i < 8 && strcmp(name, field_names[i]) != 0) {
+      i++;
+    }
+    if (i == 8) {
+      printf("Error: unknown field %s.\n", name);
+      exit(1);
     }
+    fields |= 1 << i;
   }
+  return fields;
 }
 
-byte *buf_slice(byte *buf, int start, int end) {
-  byte *result = malloc((end - start) * sizeof(char));
-  memcpy(result, buf + start, end - start);
-  return result;
+// reads the root directory a sector at a time, until the label is found.
+void print_disk_label(FILE *disk) {
+  for (int i = 0; i < ROOT_DIR_SIZE / SECTOR_SIZE; i++) {
+    byte *sector = read_sector(disk, ROOT + i);
+    for (int j = 0; j < DIRS_PER_SECTOR; j++) {
+      directory_t *dir = (directory_t *)(sector + j * DIR_SIZE);
+      int skip = should_skip_dir(*dir);
+      if (skip == 3) {
+        free(sector);
+        return;
+      } else if (skip == 1) {
+        printf("Disk Label: %8.8s\n", dir->filename);
+        free(sector);
+        return;
+      }
+    }
+    free(sector);
+  }
 }
 
 int main(int argc, char *argv[]) {
-  FILE *disk = open_disk(argv[1], "rb");
-  fat12_t fat12 = fat12_from_file(disk);
-
-  printf("OS Name: %8.8s\n", fat12.boot_sector + 3);
+  int fields = ALL_FIELDS;
+  char *image = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--fields") == 0 && i + 1 < argc) {
+      fields = parse_fields(argv[++i]);
+    } else {
+      image = argv[i];
+    }
+  }
+  if (image == NULL) {
+    printf("Usage: %s <IMAGE_NAME>.IMA [--fields FIELD,...]\n", argv[0]);
+    exit(1);
+  }
+  FILE *disk = open_disk(image, "rb");
+  // every read is a whole sector or more, so stdio buffering
+  // would only turn a 512-byte read into a larger one.
+  setvbuf(disk, NULL, _IONBF, 0);
+  byte *boot_sector = read_boot_sector(disk);
 
-  if (fat12.boot_sector[43] != 0x20 && fat12.boot_sector[43] != 0x00) {
-    printf("Disk Label: %11.11s\n", fat12.boot_sector + 43);
-  } else {
-    print_disk_label(fat12.root);
+  if (fields & FIELD_OS) {
+    printf("OS Name: %8.8s\n", boot_sector + 3);
   }
 
-  printf("Total size: %d bytes\n", fat12.total_size);
+  if (fields & FIELD_LABEL) {
+    if (boot_sector[43] != 0x20 && boot_sector[43] != 0x00) {
+      printf("Disk Label: %11.11s\n", boot_sector + 43);
+    } else {
+      print_disk_label(disk);
+    }
+  }
 
-  printf("FAT size: %d\n", fat12.fat.size);
+  int num_sectors = bytes_to_ushort(boot_sector + 19);
+  if (fields & FIELD_SIZE) {
+    printf("Total size: %d bytes\n",
+           num_sectors * bytes_to_ushort(boot_sector + 11));
+  }
 
-  printf("Free size: %d bytes\n", fat12.free_space);
+  if (fields & FIELD_FAT_SIZE) {
+    printf("FAT size: %d\n", bytes_to_ushort(boot_sector + 22) * SECTOR_SIZE);
+  }
 
-  printf("Total number of files: %d\n",
-         count_files(disk, fat12.fat.table, fat12.root));
+  index_t index;
+  if ((fields & (FIELD_FREE | FIELD_FILES)) &&
+      load_index(disk, image, &index)) {
+    if (fields & FIELD_FREE) {
+      printf("Free size: %d bytes\n", index.header->free_space);
+    }
+    if (fields & FIELD_FILES) {
+      printf("Total number of files: %d\n", index.header->num_files);
+    }
+    close_index(&index);
+  } else if (fields & (FIELD_FREE | FIELD_FILES)) {
+    fat_table_t fat = fat_table(disk, boot_sector);
+    if (fields & FIELD_FREE) {
+      printf("Free size: %d bytes\n", free_space(fat.table, num_sectors));
+    }
+    if (fields & FIELD_FILES) {
+      printf("Total number of files: %d\n", count_files(disk, fat.table));
+    }
+    free(fat.table);
+  }
   fclose(disk);
 
-  printf("FAT copies: %d\n", fat12.boot_sector[16]);
-  printf("Sectors per FAT: %d\n", bytes_to_ushort(fat12.boot_sector + 22));
-  free(fat12.boot_sector);
-  free(fat12.fat.table);
-  // count_files already freed fat12.root.dirs
+  if (fields & FIELD_FAT_COPIES) {
+    printf("FAT copies: %d\n", boot_sector[16]);
+  }
+  if (fields & FIELD_SECTORS_PER_FAT) {
+    printf("Sectors per FAT: %d\n", bytes_to_ushort(boot_sector + 22));
+  }
+  free(boot_sector);
 }
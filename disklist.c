@@ -1,8 +1,12 @@
 /* Reads the FAT12 filesystem on a floppy disk image and prints
  * the directory structure. Completely ignores all long
  * filenames, and with neither print a long file name,
- * nor print file inside a directory with a long file name. */
-#include "fat12.h"
+ * nor print file inside a directory with a long file name.
+ * Directories are read on several threads (see walk.h), and listed in order
+ * afterwards. If the image has an index, the listing is printed from it
+ * instead. */
+#include "index.h"
+#include "walk.h"
 
 void print_header(char *dirname, char *header_printed) {
   if (!*header_printed) {
@@ -30,54 +34,74 @@ void print_dir(directory_t dir) {
   }
 }
 
-void print_dirs(directory_t *dirs, char *dirname, int size) {
-  char header_printed = 0;
-  for (int i = 0; i < size; i++) {
-    directory_t dir = dirs[i];
-    switch (should_skip_dir(dir)) {
-    case 1 ... 2:
-      continue;
-    case 3:
-      return;
-    default:
-      print_header(dirname, &header_printed);
-      print_dir(dir);
+// the entries of a directory to list, kept until the walk is done.
+typedef struct listing_t {
+  int size;
+  directory_t dirs[];
+} listing_t;
+
+/* Runs on the walk's threads, so rather than printing the directory's entries
+ * it keeps the ones to list in its result, to be printed in order once the
+ * walk is done. */
+void list_dir(void *ctx, walk_dir_t *dir, byte *buf, dir_scan_t *scans,
+              int num_sectors, int thread) {
+  int size = 0;
+  for (int i = 0; i < num_sectors; i++) {
+    size += __builtin_popcount(scans[i].dirs | scans[i].files);
+  }
+  listing_t *listing = malloc(sizeof(listing_t) + size * sizeof(directory_t));
+  listing->size = 0;
+  for (int i = 0; i < num_sectors; i++) {
+    for (uint16_t keep = scans[i].dirs | scans[i].files; keep;
+         keep &= keep - 1) {
+      int entry = i * DIRS_PER_SECTOR + __builtin_ctz(keep);
+      listing->dirs[listing->size++] = *(directory_t *)(buf + entry * DIR_SIZE);
     }
   }
+  dir->result = listing;
 }
 
-void parse_dirs(FILE *disk, byte *fat_table, dir_list_t dirs, char *dirname) {
-  directory_t *dir_arr = dirs.dirs;
-  print_dirs(dir_arr, dirname, dirs.size);
-  int n = (strncmp(dirname, "Root", 4)) ? 0 : 1;
-  for (int i = 0; i < dirs.size; i++) {
-    directory_t dir = dir_arr[i];
-    switch (should_skip_dir(dir)) {
-    case 1 ... 2:
-      continue;
-    case 3:
-      return;
-    default:
-      if (dir.attribute & DIR_MASK) {
-        ushort index = bytes_to_ushort(dir.first_cluster);
-        dir_list_t next_dirs = dir_from_fat(disk, fat_table, index);
-        // append the next dir to the current dir
-        char *next_dirname = bytes_to_filename(dir.filename);
-        strcat(dirname, "/");
-        strcat(dirname, next_dirname);
-        parse_dirs(disk, fat_table, next_dirs, dirname);
-        free(next_dirs.dirs);
-      }
+// prints the listings depth first, the order a single thread would list them.
+void print_listings(walk_dir_t *dir) {
+  listing_t *listing = dir->result;
+  char header_printed = 0;
+  for (int i = 0; i < listing->size; i++) {
+    print_header(dir->path, &header_printed);
+    print_dir(listing->dirs[i]);
+  }
+  for (int i = 0; i < dir->num_children; i++) {
+    print_listings(dir->children[i]);
+  }
+}
+
+// prints each directory in the index with its entries, in the same order.
+void print_index(index_t *index) {
+  for (int i = 0; i < index->header->num_dirs; i++) {
+    index_dir_t dir = index->dirs[i];
+    char dirname[200], header_printed = 0;
+    char *path = index->paths + dir.path;
+    snprintf(dirname, 200, "Root%s%s", *path ? "/" : "", path);
+    for (int j = 0; j < dir.num_entries; j++) {
+      print_header(dirname, &header_printed);
+      print_dir(index->entries[dir.first_entry + j].dir);
     }
   }
-  free(dir_arr);
 }
 
 int main(int argc, char *argv[]) {
   FILE *disk = open_disk(argv[1], "rb");
+  index_t index;
+  if (load_index(disk, argv[1], &index)) {
+    print_index(&index);
+    close_index(&index);
+    fclose(disk);
+    return 0;
+  }
   fat12_t fat12 = fat12_from_file(disk);
-  char dirname[100] = "Root";
-  parse_dirs(disk, fat12.fat.table, fat12.root, dirname);
+  walk_dir_t *root = walk_tree(disk, fat12.fat.table, walk_threads(),
+                               list_dir, NULL);
+  print_listings(root);
+  free_walk(root);
   free_fat12(fat12);
   fclose(disk);
 }
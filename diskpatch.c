@@ -0,0 +1,85 @@
+/* Applies a delta written by diskdiff to a disk image in place. The delta
+ * records a hash of the base image it was made against, so it refuses to
+ * patch any other image, and checks the patched image against the target
+ * hash before writing anything. (Free clusters aren't hashed, see live_hash.) */
+#include "delta.h"
+
+/* Finds the FAT in an image held in memory, from its boot sector. Exits if
+ * the boot sector puts it outside the image. */
+fat_table_t image_fat(byte *image, long size) {
+  int start = bytes_to_ushort(image + 14);
+  int fat_size = bytes_to_ushort(image + 22) * SECTOR_SIZE;
+  if ((long)start * SECTOR_SIZE + fat_size > size) {
+    printf("Error: the patched image has no valid FAT.\n");
+    exit(1);
+  }
+  fat_table_t fat = {
+      .table = image + start * SECTOR_SIZE, .start = start, .size = fat_size};
+  return fat;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    printf("Usage: %s <IMAGE_NAME>.IMA <DELTA>\n", argv[0]);
+    exit(1);
+  }
+  FILE *disk = open_disk(argv[1], "rb+");
+  FILE *delta = fopen(argv[2], "rb");
+  if (delta == NULL) {
+    printf("Error: delta %s does not exist.\n", argv[2]);
+    exit(1);
+  }
+  delta_header_t header = read_delta_header(delta);
+
+  long size;
+  byte *image = map_disk(disk, &size);
+  fat12_t fat12 = fat12_from_file(disk);
+  uint64_t hash = live_hash(image, size, &fat12.fat);
+  free_fat12(fat12);
+  if (size == header.image_size && hash == header.target_hash) {
+    printf("Delta already applied to %s.\n", argv[1]);
+    exit(0);
+  } else if (size != header.image_size || hash != header.base_hash) {
+    printf("Error: %s is not the base image of this delta.\n", argv[1]);
+    exit(1);
+  }
+
+  // the runs are applied to a copy first, and only written if it hashes to
+  // the target, so a delta that can't produce it leaves the image alone.
+  byte *patched = malloc(size * sizeof(byte));
+  memcpy(patched, image, size);
+  munmap(image, size);
+  delta_run_t *runs = malloc(header.num_runs * sizeof(delta_run_t));
+  for (int i = 0; i < header.num_runs; i++) {
+    byte *data = read_delta_run(delta, runs + i, header.image_size);
+    memcpy(patched + runs[i].sector * SECTOR_SIZE, data,
+           runs[i].count * SECTOR_SIZE);
+    free(data);
+  }
+  fat_table_t patched_fat = image_fat(patched, size);
+  if (live_hash(patched, size, &patched_fat) != header.target_hash) {
+    printf("Error: patching %s would not give the target image.\n", argv[1]);
+    exit(1);
+  }
+
+  // runs are sorted by sector, so this is one forward pass over the image.
+  // The runs can change any sector, so readers are kept out until the end.
+  lock_metadata(disk);
+  int num_sectors = 0;
+  for (int i = 0; i < header.num_runs; i++) {
+    delta_run_t run = runs[i];
+    fseek(disk, run.sector * SECTOR_SIZE, SEEK_SET);
+    if (fwrite(patched + run.sector * SECTOR_SIZE, SECTOR_SIZE, run.count,
+               disk) < run.count) {
+      printf("Error: failed to write to disk.\n");
+      exit(1);
+    }
+    num_sectors += run.count;
+  }
+  unlock_metadata(disk);
+  free(runs);
+  free(patched);
+  fclose(delta);
+  fclose(disk);
+  printf("Patched %d sectors in %d runs.\n", num_sectors, header.num_runs);
+}
@@ -1,6 +1,9 @@
-#include "fat12.h"
+#include "index.h"
+#include "stream.h"
 #include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -50,42 +53,117 @@ void update_fat_table(byte *fat_table, ushort value, int index) {
   }
 }
 
-/* Recursivly writes the file to the disk until the remaining file size is less
- * than a sector, updates the FAT table buffer along the way. */
+typedef struct host_reader_t {
+  FILE *source;
+  int remaining;
+} host_reader_t;
+
+typedef struct disk_writer_t {
+  FILE *disk;
+  fat_table_t fat;
+  int index;
+  int remaining;
+} disk_writer_t;
+
+// reads up to cap bytes of what is left of the file on the host.
+int read_host(void *ctx, byte *buf, int cap) {
+  host_reader_t *host = ctx;
+  int want = (host->remaining < cap) ? host->remaining : cap;
+  if (want == 0) {
+    return 0;
+  }
+  int len = fread(buf, 1, want, host->source);
+  if (len == 0) {
+    printf("Error: input ended before the end of the file.\n");
+    exit(1);
+  }
+  host->remaining -= len;
+  return len;
+}
+
+/* Writes len bytes of the file to the disk, allocating a free sector for each
+ * 512 bytes and chaining them together in the FAT table buffer. Each run of
+ * consecutive sectors is written with a single write. */
+void write_sectors(void *ctx, byte *buf, int len) {
+  disk_writer_t *out = ctx;
+  int num_sectors = (len + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  int run_start = 0, run_index = out->index;
+  for (int i = 0; i < num_sectors; i++) {
+    int end = (i + 1) * SECTOR_SIZE < len ? (i + 1) * SECTOR_SIZE : len;
+    out->remaining -= end - i * SECTOR_SIZE;
+    ushort next_index = (out->remaining > 0)
+                            ? next_free_index(out->fat, out->index)
+                            : 0xFFF;
+    update_fat_table(out->fat.table, next_index, out->index);
+    if (next_index != out->index + 1 || i == num_sectors - 1) {
+      write_to_disk(out->disk, buf + run_start * SECTOR_SIZE,
+                    (run_index + SECTOR_OFFSET) * SECTOR_SIZE, 1,
+                    end - run_start * SECTOR_SIZE);
+      run_start = i + 1;
+      run_index = next_index;
+    }
+    out->index = next_index;
+  }
+}
+
+/* Writes the file to the disk starting at index, updating the FAT table buffer
+ * along the way. Reading from the host is done on another thread, so it
+ * overlaps with writing to the disk. */
 void write_file(FILE *src_file, FILE *dest_disk, fat12_t fat12, int index,
                 int size) {
-  int sector = (index + SECTOR_OFFSET) * SECTOR_SIZE;
-  if (size < SECTOR_SIZE) {
-    byte buf[size];
-    fread(buf, 1, size, src_file);
-    write_to_disk(dest_disk, buf, sector, 1, size);
-    update_fat_table(fat12.fat.table, 0xFFF, index);
-  } else {
-    byte buf[SECTOR_SIZE];
-    fread(buf, 1, SECTOR_SIZE, src_file);
-    write_to_disk(dest_disk, buf, sector, 1, SECTOR_SIZE);
-    ushort next_index = next_free_index(fat12.fat, index);
-    write_file(src_file, dest_disk, fat12, next_index, size - SECTOR_SIZE);
-    update_fat_table(fat12.fat.table, next_index, index);
+  // even an empty file takes up its first sector.
+  update_fat_table(fat12.fat.table, 0xFFF, index);
+  host_reader_t host = {.source = src_file, .remaining = size};
+  disk_writer_t out = {
+      .disk = dest_disk, .fat = fat12.fat, .index = index, .remaining = size};
+  double_buffer(read_host, &host, write_sectors, &out);
+}
+
+/* Reads all of src_file into memory, for input of unknown size where the size
+ * is needed before anything can be written. Sets size to the bytes read. */
+byte *read_all(FILE *src_file, int *size) {
+  int capacity = STREAM_BUF_SIZE;
+  byte *data = malloc(capacity * sizeof(byte));
+  *size = 0;
+  int len;
+  while ((len = fread(data + *size, 1, capacity - *size, src_file)) > 0) {
+    *size += len;
+    if (*size == capacity) {
+      capacity *= 2;
+      data = realloc(data, capacity * sizeof(byte));
+    }
   }
+  return data;
+}
+
+// packs the time of day the way FAT directory entries store it.
+ushort fat_time(struct tm *time) {
+  return (time->tm_hour << 11) | (time->tm_min << 5) | (time->tm_sec / 2);
+}
+
+ushort fat_date(struct tm *time) {
+  return ((time->tm_year - 80) << 9) | ((time->tm_mon + 1) << 5) |
+         time->tm_mday;
 }
 
 directory_t create_dir(dir_info_t dir_info) {
   char *filename = dir_info.filename;
   ushort start_index = dir_info.first_cluster;
-  ushort size = dir_info.size;
+  uint size = dir_info.size;
   directory_t dir;
+  memset(&dir, 0, sizeof(directory_t));
   int i = 0;
-  while (i < 13) {
-    if (filename[i] == '.') {
-      break;
-    }
+  while (i < 8 && filename[i] && filename[i] != '.') {
     i++;
   }
   memcpy(dir.filename, filename, i);
-  // pad the rest of the filename with 0x20
+  // pad the rest of the filename and extension with 0x20
   memset(dir.filename + i, 0x20, 8 - i);
-  memcpy(dir.extension, filename + i + 1, 3);
+  memset(dir.extension, 0x20, 3);
+  char *ext = strchr(filename, '.');
+  for (int j = 0; ext && j < 3 && ext[j + 1]; j++) {
+    dir.extension[j] = ext[j + 1];
+  }
   dir.attribute = 0x20;
 
   for (int i = 0; i < 4; i++) {
@@ -96,12 +174,9 @@ directory_t create_dir(dir_info_t dir_info) {
     dir.first_cluster[i] = (byte)(start_index >> (i * 8));
   }
 
-  struct tm *time = dir_info.timestamp;
-  ushort time_stamp =
-      (time->tm_hour << 11) | (time->tm_min << 5) | (time->tm_sec / 2);
+  ushort time_stamp = fat_time(dir_info.timestamp);
   memcpy(&dir.creation_time, &time_stamp, 2);
-  ushort date_stamp =
-      ((time->tm_year - 80) << 9) | (time->tm_mon << 5) | time->tm_mday;
+  ushort date_stamp = fat_date(dir_info.timestamp);
   memcpy(&dir.creation_date, &date_stamp, 2);
   memcpy(&dir.last_access_date, &date_stamp, 2);
   memcpy(&dir.last_modified_time, &time_stamp, 2);
@@ -109,212 +184,597 @@ directory_t create_dir(dir_info_t dir_info) {
   return dir;
 }
 
-void add_dir_to_sector(byte *sector, dir_info_t dir_info) {
-  // sector will be a pointer to the position in the sector to add the directory
-  directory_t dir = create_dir(dir_info);
-  memcpy(sector, &dir, sizeof(directory_t));
+/* A directory of the image loaded into memory for --sync (or a single put).
+ * Entries are added, changed and deleted in buf, and all the changed
+ * directories are written back at the end along with the FAT table. */
+typedef struct image_dir_t {
+  byte *buf;
+  byte *seen; // which entries have a matching file on the host.
+  int num_entries;
+  int cluster; // 0 for the root directory.
+  int dirty;
+  struct image_dir_t *next;
+} image_dir_t;
+
+// a changed file's new contents and the chain they are written over.
+typedef struct rewrite_t {
+  ushort cluster;
+  byte *data;
+  int size;
+} rewrite_t;
+
+typedef struct sync_t {
+  FILE *disk;
+  fat12_t fat12;
+  int hash;
+  int delete;
+  image_dir_t *dirs;
+  // chains to free when the FAT is written, see release_chain.
+  ushort *released;
+  int num_released;
+  // files to write over their old clusters at commit, see rewrite_chain.
+  rewrite_t *rewrites;
+  int num_rewrites;
+  int added, rewritten, skipped, deleted, dirs_created;
+} sync_t;
+
+image_dir_t *load_dir(sync_t *sync, int cluster) {
+  image_dir_t *dir = malloc(sizeof(image_dir_t));
+  if (cluster == 0) {
+    dir->num_entries = DIRS_IN_ROOT;
+    dir->buf = malloc(ROOT_DIR_SIZE * sizeof(byte));
+    read_from_disk(sync->disk, dir->buf, ROOT * SECTOR_SIZE, ROOT_DIR_SIZE, 1);
+  } else {
+    ushort index = cluster;
+    byte **bufs = read_dir_batch(sync->disk, sync->fat12.fat.table, &index, 1,
+                                 &dir->num_entries);
+    dir->buf = bufs[0];
+    free(bufs);
+  }
+  dir->seen = calloc(dir->num_entries, sizeof(byte));
+  dir->cluster = cluster;
+  dir->dirty = 0;
+  dir->next = sync->dirs;
+  sync->dirs = dir;
+  return dir;
+}
+
+directory_t *entry_at(image_dir_t *dir, int i) {
+  return (directory_t *)(dir->buf + i * DIR_SIZE);
+}
+
+// converts a host file name into a padded 8.3 name, 0 if it doesn't fit.
+int to_83(char *name, byte *name83) {
+  char *dot = strrchr(name, '.');
+  int base_len = dot ? dot - name : strlen(name);
+  int ext_len = dot ? strlen(dot + 1) : 0;
+  if (base_len == 0 || base_len > 8 || ext_len > 3) {
+    return 0;
+  }
+  memset(name83, 0x20, 11);
+  for (int i = 0; i < base_len; i++) {
+    name83[i] = toupper(name[i]);
+  }
+  for (int i = 0; i < ext_len; i++) {
+    name83[8 + i] = toupper(dot[i + 1]);
+  }
+  return 1;
 }
 
-// Extracts the top-most directory name out of dirpath, and also removes it from
-// dirpath. Returns pointer to the extracted directory name.
-char *get_target(char *dirpath) {
-  char *target = malloc(13);
-  // check if there are any '\' left in dirpath
-  for (int i = 0; i < 12; i++) {
-    if (dirpath[i] == '/' || dirpath[i] == '\0') {
-      target[i] = '\0';
-      // move the rest of dirpath forward
-      for (int j = i + 1; j < strlen(dirpath); j++) {
-        dirpath[j - i - 1] = dirpath[j];
+// the NAME.EXT form of a padded 8.3 name, as create_dir expects.
+void name_from_83(byte *name83, char *name) {
+  int len = 0;
+  for (int i = 0; i < 8 && name83[i] != 0x20; i++) {
+    name[len++] = name83[i];
+  }
+  if (name83[8] != 0x20) {
+    name[len++] = '.';
+  }
+  for (int i = 8; i < 11 && name83[i] != 0x20; i++) {
+    name[len++] = name83[i];
+  }
+  name[len] = '\0';
+}
+
+/* Index of the entry in use with the 8.3 name, or -1 if there isn't one. A
+ * long name entry could only match by chance, so matches are checked for it
+ * one at a time. */
+int find_entry(image_dir_t *dir, byte *name83) {
+  dir_scan_t scans[dir->num_entries / DIRS_PER_SECTOR];
+  int num_sectors = scan_dirs(dir->buf, dir->num_entries, scans);
+  for (int i = 0; i < num_sectors; i++) {
+    uint16_t match = scan_name(dir->buf + i * SECTOR_SIZE, name83) &
+                     scans[i].used & ~scans[i].label & ~scans[i].dots;
+    for (; match; match &= match - 1) {
+      int entry = i * DIRS_PER_SECTOR + __builtin_ctz(match);
+      if (entry_at(dir, entry)->attribute != LONG_NAME) {
+        return entry;
       }
-      dirpath[strlen(dirpath) - i - 1] = '\0';
-      break;
     }
-    target[i] = dirpath[i];
-    // also clear from dirpath
-    if (i + 1 < 12) {
-      dirpath[i] = dirpath[i + 1];
+  }
+  return -1;
+}
+
+/* Finds a free entry in the directory, adding another cluster to the end of
+ * the directory if it is full. (The root directory can't grow.) */
+int free_entry(sync_t *sync, image_dir_t *dir) {
+  dir_scan_t scans[dir->num_entries / DIRS_PER_SECTOR];
+  scan_dirs(dir->buf, dir->num_entries, scans);
+  for (int i = 0; i < dir->num_entries / DIRS_PER_SECTOR; i++) {
+    uint16_t unused = ~scans[i].used;
+    if (unused) {
+      return i * DIRS_PER_SECTOR + __builtin_ctz(unused);
     }
   }
-  return target;
+  if (dir->cluster == 0) {
+    printf("Error: root directory is full.\n");
+    exit(1);
+  }
+  byte *fat_table = sync->fat12.fat.table;
+  int last = dir->cluster;
+  while (!last_sector(fat_entry(fat_table, last), "free_entry")) {
+    last = fat_entry(fat_table, last);
+  }
+  ushort new_index = next_free_index(sync->fat12.fat, 1);
+  update_fat_table(fat_table, new_index, last);
+  update_fat_table(fat_table, 0xFFF, new_index);
+
+  int i = dir->num_entries;
+  dir->num_entries += DIRS_PER_SECTOR;
+  dir->buf = realloc(dir->buf, dir->num_entries * DIR_SIZE);
+  dir->seen = realloc(dir->seen, dir->num_entries);
+  memset(dir->buf + i * DIR_SIZE, 0, SECTOR_SIZE);
+  memset(dir->seen + i, 0, DIRS_PER_SECTOR);
+  return i;
 }
 
-void add_to_sector(FILE *disk, fat12_t fat12, int index, dir_info_t dir_info,
-                   char *dirpath);
+void set_entry(image_dir_t *dir, int i, directory_t entry) {
+  memcpy(entry_at(dir, i), &entry, sizeof(directory_t));
+  dir->seen[i] = 1;
+  dir->dirty = 1;
+}
 
-void find_next_dir(FILE *disk, fat12_t fat12, int index, dir_info_t dir_info,
-                   char *dirpath, char *target) {
+void free_chain(byte *fat_table, int index) {
+  while (index > 1 && index < LAST_SECTOR) {
+    int next_index = fat_entry(fat_table, index);
+    update_fat_table(fat_table, 0x000, index);
+    index = next_index;
+  }
+}
 
-  int sector_num = index + SECTOR_OFFSET;
-  byte *sector = read_sector(disk, sector_num);
-  for (int i = 0; i < SECTOR_SIZE; i += sizeof(directory_t)) {
-    directory_t *dir = (directory_t *)(sector + i);
-    switch (should_skip_dir(*dir)) {
-    case 3:
-      return;
-    case 1 ... 2:
-      continue;
-    default:
-      if (dir->filename[0] == DOT) {
-        continue;
-      }
-      // check if one of the dirs is the target on the dirpath.
-      char *dirname = filename_ext(*dir);
-      if (dir->attribute & DIR_MASK) {
-        // if the dir is a directory, check if it is the target
-        // and if it is, recurse into that directory.
-        if (strncmp(target, dirname, 12) == 0) {
-          ushort next_index = bytes_to_ushort(dir->first_cluster);
-          printf("Found directory %s\n", target);
-          add_to_sector(disk, fat12, next_index, dir_info, dirpath);
-          free(sector);
-          return;
-        }
-      }
-    }
+/* Frees the chain when the sync is committed rather than now, so none of its
+ * clusters can be reused for new data while readers might still be reading
+ * the old file or directory through the metadata in the image. */
+void release_chain(sync_t *sync, int index) {
+  sync->released =
+      realloc(sync->released, (sync->num_released + 1) * sizeof(ushort));
+  sync->released[sync->num_released++] = index;
+}
+
+/* Overwrites the file's existing cluster chain in place with data, for a
+ * changed file that still takes the same number of clusters. Each run of
+ * consecutive clusters is written with a single write. Only called while the
+ * metadata is locked, so no reader sees the file half rewritten. */
+void rewrite_chain(FILE *disk, byte *fat_table, rewrite_t rewrite) {
+  int count = (rewrite.size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  read_req_t *runs = malloc(count * sizeof(read_req_t));
+  int index = rewrite.cluster;
+  int num_runs = chain_reads(fat_table, &index, count, rewrite.data, runs);
+  byte *end = rewrite.data + rewrite.size;
+  for (int i = 0; i < num_runs; i++) {
+    int run_len = (runs[i].buf + runs[i].len <= end) ? runs[i].len
+                                                     : end - runs[i].buf;
+    write_to_disk(disk, runs[i].buf, runs[i].offset, 1, run_len);
   }
+  free(runs);
 }
 
-void add_to_sector(FILE *disk, fat12_t fat12, int index, dir_info_t dir_info,
-                   char *dirpath) {
-
-  char *target = get_target(dirpath);
-  int sector_num = index + SECTOR_OFFSET;
-  byte *sector = read_sector(disk, sector_num);
-
-  if (strncmp(target, dir_info.filename, 12) == 0) {
-    for (int i = 0; i < SECTOR_SIZE; i += sizeof(directory_t)) {
-      directory_t *dir = (directory_t *)(sector + i);
-      switch (should_skip_dir(*dir)) {
-      case 2 ... 3:
-        add_dir_to_sector(sector + i, dir_info);
-        write_to_disk(disk, sector, sector_num * 512, SECTOR_SIZE, 1);
-        free(sector);
-        return;
-      default:
-        NULL;
-        char *dirname = filename_ext(*dir);
-        if (strncmp(dir_info.filename, dirname, 8) == 0) {
-          printf("Error: File already exists\n");
-          free(sector);
-          free(target);
-          exit(1);
-        }
-      }
-    }
-  } else {
-    find_next_dir(disk, fat12, index, dir_info, dirpath, target);
+/* Compares the host file byte for byte with the file in the image. A host
+ * file that can't be opened counts as changed, so the caller's own open
+ * reports it. */
+int same_content(sync_t *sync, directory_t *entry, char *host_path) {
+  int size = bytes_to_uint(entry->file_size);
+  FILE *source = fopen(host_path, "rb");
+  if (source == NULL) {
+    return 0;
+  }
+  int host_size;
+  byte *host_data = read_all(source, &host_size);
+  fclose(source);
+  if (host_size != size) {
+    free(host_data);
+    return 0;
+  }
+
+  byte *fat_table = sync->fat12.fat.table;
+  int index = bytes_to_ushort(entry->first_cluster);
+  int count = chain_length(fat_table, index);
+  byte *image_data = malloc(count * SECTOR_SIZE * sizeof(byte));
+  read_req_t *reqs = malloc(count * sizeof(read_req_t));
+  int num_reqs = chain_reads(fat_table, &index, count, image_data, reqs);
+  read_batch(sync->disk, reqs, num_reqs);
+
+  int same = count * SECTOR_SIZE >= size &&
+             memcmp(host_data, image_data, size) == 0;
+  free(host_data);
+  free(image_data);
+  free(reqs);
+  return same;
+}
+
+/* Puts the host file into the image directory if it is new, or if its size or
+ * modified time (or contents, with --hash) differ from the entry in the image.
+ * A changed file that needs the same number of clusters is rewritten over its
+ * old clusters when the sync commits. Otherwise it is written to new
+ * clusters, and its old chain released. */
+void sync_file(sync_t *sync, image_dir_t *dir, char *host_path,
+               byte *name83, struct stat *attr) {
+  int size = attr->st_size;
+  struct tm *time = localtime(&attr->st_mtime);
+  int i = find_entry(dir, name83);
+  directory_t *entry = (i >= 0) ? entry_at(dir, i) : NULL;
+  if (entry && (entry->attribute & DIR_MASK)) {
+    printf("Skipping %s: it is a directory in the image.\n", host_path);
+    dir->seen[i] = 1;
+    return;
+  }
+  ushort first_cluster = entry ? bytes_to_ushort(entry->first_cluster) : 0;
+  if (entry && bytes_to_uint(entry->file_size) == size &&
+      bytes_to_ushort(entry->last_modified_time) == fat_time(time) &&
+      bytes_to_ushort(entry->last_modified_date) == fat_date(time) &&
+      (!sync->hash || same_content(sync, entry, host_path))) {
+    sync->skipped++;
+    dir->seen[i] = 1;
     return;
   }
 
-  // if we get here, the sector is full, check the next one.
-  if (index >= LAST_SECTOR) {
-    // if the next sector is the last sector, we need to add a new sector.
-    // Create a new sector and add the directory to it, then write this sector
-    // into the disk at the first available index.
-    ushort free_index = next_free_index(fat12.fat, 1);
-    byte new_sector[SECTOR_SIZE];
-    memset(new_sector, 0, SECTOR_SIZE);
-    add_dir_to_sector(new_sector, dir_info);
-    write_to_disk(disk, new_sector, sector_num * SECTOR_SIZE, SECTOR_SIZE, 1);
-    update_fat_table(fat12.fat.table, free_index, index);
-  } else if (index != 0) {
-    // move to the next sector of this directory.
-    int next_index = fat_entry(fat12.fat.table, index);
-    add_to_sector(disk, fat12, next_index, dir_info, dirpath);
+  FILE *source = fopen(host_path, "rb");
+  if (source == NULL) {
+    printf("Skipping %s: could not open it.\n", host_path);
+    return;
+  }
+  int num_clusters = size ? (size + SECTOR_SIZE - 1) / SECTOR_SIZE : 1;
+  if (first_cluster > 1 &&
+      chain_length(sync->fat12.fat.table, first_cluster) == num_clusters) {
+    rewrite_t rewrite = {.cluster = first_cluster};
+    rewrite.data = read_all(source, &rewrite.size);
+    if (rewrite.size < size) {
+      printf("Error: input ended before the end of the file.\n");
+      exit(1);
+    }
+    rewrite.size = size;
+    sync->rewrites = realloc(sync->rewrites,
+                             (sync->num_rewrites + 1) * sizeof(rewrite_t));
+    sync->rewrites[sync->num_rewrites++] = rewrite;
+  } else {
+    if (first_cluster > 1) {
+      release_chain(sync, first_cluster);
+    }
+    first_cluster = next_free_index(sync->fat12.fat, 1);
+    write_file(source, sync->disk, sync->fat12, first_cluster, size);
+  }
+  fclose(source);
+  if (entry) {
+    sync->rewritten++;
+  } else {
+    i = free_entry(sync, dir);
+    sync->added++;
   }
+
+  dir_info_t dir_info = {
+      .size = size, .first_cluster = first_cluster, .timestamp = time};
+  name_from_83(name83, dir_info.filename);
+  set_entry(dir, i, create_dir(dir_info));
 }
 
-void add_to_tree(FILE *disk, FILE *source, fat12_t fat12, dir_info_t dir_info,
-                 char *dirpath) {
-  char *filename = dir_info.filename;
-  int size = dir_info.size;
-  ushort file_index = dir_info.first_cluster;
+// writes a . or .. entry pointing at cluster into the directory sector.
+void dot_entry(byte *sector, char *name, ushort cluster, directory_t *parent) {
+  directory_t dot = *parent;
+  memset(dot.filename, 0x20, 11);
+  memcpy(dot.filename, name, strlen(name));
+  dot.first_cluster[0] = cluster & 0xFF;
+  dot.first_cluster[1] = cluster >> 8;
+  memcpy(sector, &dot, sizeof(directory_t));
+}
 
-  // check if the filename already exists
-  for (int i = 0; i < DIRS_IN_ROOT; i++) {
+/* Loads the subdirectory of dir with the 8.3 name, creating it with . and ..
+ * entries if it doesn't exist yet. Returns NULL if the name is a file. */
+image_dir_t *open_subdir(sync_t *sync, image_dir_t *dir, byte *name83,
+                         time_t mtime) {
+  int i = find_entry(dir, name83);
+  if (i >= 0) {
+    directory_t *entry = entry_at(dir, i);
+    dir->seen[i] = 1;
+    if (!(entry->attribute & DIR_MASK)) {
+      return NULL;
+    }
+    return load_dir(sync, bytes_to_ushort(entry->first_cluster));
   }
 
-  // read out the directory path until the first / character
-  char *target = get_target(dirpath);
+  ushort cluster = next_free_index(sync->fat12.fat, 1);
+  update_fat_table(sync->fat12.fat.table, 0xFFF, cluster);
+  dir_info_t dir_info = {
+      .size = 0, .first_cluster = cluster, .timestamp = localtime(&mtime)};
+  name_from_83(name83, dir_info.filename);
+  directory_t entry = create_dir(dir_info);
+  entry.attribute = DIR_MASK;
+  set_entry(dir, free_entry(sync, dir), entry);
+
+  image_dir_t *subdir = malloc(sizeof(image_dir_t));
+  subdir->num_entries = DIRS_PER_SECTOR;
+  subdir->buf = calloc(SECTOR_SIZE, sizeof(byte));
+  subdir->seen = calloc(DIRS_PER_SECTOR, sizeof(byte));
+  subdir->cluster = cluster;
+  subdir->dirty = 1;
+  subdir->next = sync->dirs;
+  sync->dirs = subdir;
+  dot_entry(subdir->buf, ".", cluster, &entry);
+  dot_entry(subdir->buf + DIR_SIZE, "..", dir->cluster, &entry);
+  sync->dirs_created++;
+  return subdir;
+}
 
-  for (int i = 0; i < fat12.root.size; i++) {
-    directory_t dir = fat12.root.dirs[i];
-    switch (should_skip_dir(dir)) {
-    case 1:
-      continue;
-    case 2 ... 3:
-      if (strncmp(target, filename, 8) == 0) {
-        directory_t new_dir = create_dir(dir_info);
-        // write the directory to the root directory
-        memcpy(fat12.root.dirs + i, &new_dir, sizeof(directory_t));
-        write_to_disk(disk, fat12.root.dirs, 19 * 512, sizeof(directory_t),
-                      DIRS_IN_ROOT);
-        printf("Added %s to root directory.\n", filename);
-        free(target);
-        return;
-      } else {
-        printf("%s not found in root directory.\n", target);
-        free(target);
-        exit(1);
-        return;
-      }
-    default:
-      if (dir.filename[0] == DOT) {
+// frees the clusters of everything inside the directory, and the directory.
+void delete_tree(sync_t *sync, int cluster) {
+  ushort index = cluster;
+  int num_entries;
+  byte **bufs = read_dir_batch(sync->disk, sync->fat12.fat.table, &index, 1,
+                               &num_entries);
+  dir_scan_t scans[num_entries / DIRS_PER_SECTOR];
+  int num_sectors = scan_dirs(bufs[0], num_entries, scans);
+  for (int i = 0; i < num_sectors; i++) {
+    directory_t *entries = (directory_t *)(bufs[0] + i * SECTOR_SIZE);
+    for (uint16_t dirs = scans[i].dirs; dirs; dirs &= dirs - 1) {
+      int j = __builtin_ctz(dirs);
+      delete_tree(sync, bytes_to_ushort(entries[j].first_cluster));
+    }
+    for (uint16_t files = scans[i].files; files; files &= files - 1) {
+      release_chain(sync,
+                    bytes_to_ushort(entries[__builtin_ctz(files)].first_cluster));
+    }
+  }
+  free(bufs[0]);
+  free(bufs);
+  release_chain(sync, cluster);
+}
+
+// deletes every entry in the directory that wasn't found on the host.
+void delete_unseen(sync_t *sync, image_dir_t *dir) {
+  dir_scan_t scans[dir->num_entries / DIRS_PER_SECTOR];
+  int num_sectors = scan_dirs(dir->buf, dir->num_entries, scans);
+  for (int i = 0; i < num_sectors; i++) {
+    uint16_t entries = scans[i].used & ~scans[i].label & ~scans[i].dots;
+    for (; entries; entries &= entries - 1) {
+      int j = i * DIRS_PER_SECTOR + __builtin_ctz(entries);
+      directory_t *entry = entry_at(dir, j);
+      if (dir->seen[j] || entry->attribute == LONG_NAME) {
         continue;
       }
-      NULL;
-      char *dirname = filename_ext(dir);
-      if (strcmp(filename, dirname) == 0) {
-        printf("Error: file already exists.\n");
-        exit(1);
+      ushort cluster = bytes_to_ushort(entry->first_cluster);
+      if (entry->attribute & DIR_MASK) {
+        delete_tree(sync, cluster);
+      } else {
+        release_chain(sync, cluster);
       }
-      if (strcmp(dirname, target) == 0) {
-        printf("Found directory %s\n", dirname);
-        ushort index = bytes_to_ushort(dir.first_cluster);
-        add_to_sector(disk, fat12, index, dir_info, dirpath);
-        return;
+      entry->filename[0] = FILE_FREE;
+      dir->dirty = 1;
+      sync->deleted++;
+    }
+  }
+}
+
+void sync_dir(sync_t *sync, char *host_dir, image_dir_t *dir) {
+  DIR *host = opendir(host_dir);
+  if (host == NULL) {
+    printf("Error: %s is not a directory on the host system.\n", host_dir);
+    exit(1);
+  }
+  struct dirent *host_entry;
+  while ((host_entry = readdir(host)) != NULL) {
+    char *name = host_entry->d_name;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+      continue;
+    }
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%s", host_dir, name);
+    struct stat attr;
+    byte name83[11];
+    if (stat(path, &attr) != 0) {
+      continue;
+    } else if (!to_83(name, name83)) {
+      printf("Skipping %s: not an 8.3 file name.\n", path);
+    } else if (S_ISDIR(attr.st_mode)) {
+      image_dir_t *subdir = open_subdir(sync, dir, name83, attr.st_mtime);
+      if (subdir == NULL) {
+        printf("Skipping %s: it is a file in the image.\n", path);
+      } else {
+        sync_dir(sync, path, subdir);
       }
+    } else if (S_ISREG(attr.st_mode)) {
+      sync_file(sync, dir, path, name83, &attr);
     }
   }
+  closedir(host);
+  if (sync->delete) {
+    delete_unseen(sync, dir);
+  }
 }
 
-int main(int argc, char *argv[]) {
-  FILE *disk = open_disk(argv[1], "rb+");
-  char *filename = (argc == 3) ? argv[2] : argv[3];
-  char *dir = (argc == 3) ? 0x00 : argv[2];
+/* Commits the sync: frees the released chains, then rewrites files in place
+ * and writes the FAT table to every FAT copy and every directory that changed
+ * while the metadata is locked, so readers see all of the changes from the
+ * sync or none of them. */
+void flush_sync(sync_t *sync) {
+  fat_table_t fat = sync->fat12.fat;
+  for (int i = 0; i < sync->num_released; i++) {
+    free_chain(fat.table, sync->released[i]);
+  }
+  free(sync->released);
+  lock_metadata(sync->disk);
+  for (int i = 0; i < sync->num_rewrites; i++) {
+    rewrite_chain(sync->disk, fat.table, sync->rewrites[i]);
+    free(sync->rewrites[i].data);
+  }
+  free(sync->rewrites);
+  for (int i = 0; i < sync->fat12.boot_sector[16]; i++) {
+    write_to_disk(sync->disk, fat.table, (fat.start * SECTOR_SIZE) + i * fat.size,
+                  fat.size, 1);
+  }
+  while (sync->dirs) {
+    image_dir_t *dir = sync->dirs;
+    if (dir->dirty && dir->cluster == 0) {
+      write_to_disk(sync->disk, dir->buf, ROOT * SECTOR_SIZE, ROOT_DIR_SIZE, 1);
+    } else if (dir->dirty) {
+      int index = dir->cluster;
+      for (int i = 0; i * DIRS_PER_SECTOR < dir->num_entries; i++) {
+        write_to_disk(sync->disk, dir->buf + i * SECTOR_SIZE,
+                      (index + SECTOR_OFFSET) * SECTOR_SIZE, SECTOR_SIZE, 1);
+        index = fat_entry(fat.table, index);
+      }
+    }
+    sync->dirs = dir->next;
+    free(dir->buf);
+    free(dir->seen);
+    free(dir);
+  }
+  unlock_metadata(sync->disk);
+}
 
-  if (disk == NULL) {
-    printf("Error opening disk image.\n");
+/* diskput <IMAGE> --sync <HOST_DIR> [<IMAGE_DIR>] [--hash] [--delete]
+ * Puts every new or changed file under the host directory into the image
+ * directory, creating subdirectories as needed. */
+int sync_main(int argc, char *argv[]) {
+  char *args[3];
+  int num_args = 0;
+  sync_t sync = {.dirs = NULL};
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--hash") == 0) {
+      sync.hash = 1;
+    } else if (strcmp(argv[i], "--delete") == 0) {
+      sync.delete = 1;
+    } else if (strcmp(argv[i], "--sync") != 0 && num_args < 3) {
+      args[num_args++] = argv[i];
+    }
   }
-  FILE *source = fopen(filename, "rb");
-  if (source == NULL) {
-    printf("Error: %s does not exist on host system.\n", filename);
+  if (num_args < 2) {
+    printf("Usage: %s <IMAGE_NAME>.IMA --sync <HOST_DIR> [<IMAGE_DIR>] "
+           "[--hash] [--delete]\n",
+           argv[0]);
     exit(1);
   }
+  sync.disk = open_disk(args[0], "rb+");
+  sync.fat12 = fat12_from_file(sync.disk);
+
+  // find (or create) the directory in the image to sync into.
+  image_dir_t *dir = load_dir(&sync, 0);
+  char *image_dir = (num_args == 3) ? args[2] : "";
+  for (char *name = strtok(image_dir, "/"); name; name = strtok(NULL, "/")) {
+    byte name83[11];
+    if (!to_83(name, name83) ||
+        (dir = open_subdir(&sync, dir, name83, time(NULL))) == NULL) {
+      printf("Error: %s is not a directory in the image.\n", name);
+      exit(1);
+    }
+  }
+  sync_dir(&sync, args[1], dir);
 
-  // remove the leading / from the directory path if it exists
-  if (dir != NULL) {
-    int o = (dir[0] == '/');
-    for (int i = 0; dir[i + o]; i++) {
-      dir[i] = toupper(dir[i + o]);
+  flush_sync(&sync);
+  if (index_exists(args[0])) {
+    build_index(sync.disk, args[0]);
+  }
+  printf("Sync complete: %d added, %d rewritten, %d skipped, %d deleted, "
+         "%d directories created.\n",
+         sync.added, sync.rewritten, sync.skipped, sync.deleted,
+         sync.dirs_created);
+  fclose(sync.disk);
+  free_fat12(sync.fat12);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--sync") == 0) {
+      return sync_main(argc, argv);
     }
-    dir[strlen(dir) - 1] = 0x00;
-    if (dir[strlen(dir) - 1] == '/') {
-      dir[strlen(dir) - 1] = 0x00;
+  }
+  char *args[4];
+  int num_args = 0, size = -1;
+  time_t mtime = time(NULL);
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+      size = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--mtime") == 0 && i + 1 < argc) {
+      mtime = atol(argv[++i]);
+    } else if (num_args < 4) {
+      args[num_args++] = argv[i];
     }
   }
+  // a trailing - reads the file from stdin, and names it with the argument
+  // before it, instead of opening that file on the host.
+  int from_stdin = num_args > 2 && strcmp(args[num_args - 1], "-") == 0;
+  num_args -= from_stdin;
+  if (num_args < 2 || num_args > 3) {
+    printf("Usage: %s <IMAGE_NAME>.IMA [<DIRECTORY>] <FILE> [- [--size N] "
+           "[--mtime SECONDS]]\n",
+           argv[0]);
+    exit(1);
+  }
+  FILE *disk = open_disk(args[0], "rb+");
+  char *filename = args[num_args - 1];
+  char *dir = (num_args == 2) ? NULL : args[1];
 
-  // make the filename uppercase
-  for (int i = 0; filename[i]; i++) {
-    filename[i] = toupper(filename[i]);
+  FILE *source = from_stdin ? stdin : fopen(filename, "rb");
+  if (source == NULL) {
+    printf("Error: %s does not exist on host system.\n", filename);
+    exit(1);
   }
+  // the file keeps its name, without the host directories leading up to it.
+  char *name = strrchr(filename, '/') ? strrchr(filename, '/') + 1 : filename;
+  byte name83[11];
+  if (!to_83(name, name83)) {
+    printf("Error: %s is not an 8.3 file name.\n", name);
+    exit(1);
+  }
+
+  // a single put goes through the same directory handling as --sync.
   fat12_t fat12 = fat12_from_file(disk);
+  sync_t put = {.disk = disk, .fat12 = fat12, .dirs = NULL};
+  image_dir_t *target = load_dir(&put, 0);
+  if (dir != NULL) {
+    printf("Copying %s to subdirectory: %s\n", name, dir);
+    char dirpath[200];
+    strncpy(dirpath, dir, 199);
+    dirpath[199] = '\0';
+    for (char *d = strtok(dirpath, "/"); d; d = strtok(NULL, "/")) {
+      byte dir83[11];
+      int i = to_83(d, dir83) ? find_entry(target, dir83) : -1;
+      if (i < 0 || !(entry_at(target, i)->attribute & DIR_MASK)) {
+        printf("%s not found in %s.\n", d,
+               target->cluster ? "its parent directory" : "root directory");
+        exit(1);
+      }
+      printf("Found directory %s\n", d);
+      ushort cluster = bytes_to_ushort(entry_at(target, i)->first_cluster);
+      target = load_dir(&put, cluster);
+    }
+  }
+  if (find_entry(target, name83) >= 0) {
+    printf("Error: File already exists\n");
+    exit(1);
+  }
 
-  struct stat attr;
-  stat(filename, &attr);
-  struct tm *time = localtime(&attr.st_mtime);
-  int size = attr.st_size;
+  byte *data = NULL;
+  if (!from_stdin) {
+    struct stat attr;
+    fstat(fileno(source), &attr);
+    mtime = attr.st_mtime;
+    size = attr.st_size;
+  } else if (size < 0) {
+    // without --size, stdin has to be read in full to find the size.
+    data = read_all(stdin, &size);
+    source = size ? fmemopen(data, size, "rb") : NULL;
+  }
+  struct tm *time = localtime(&mtime);
   printf("File size: %d bytes\n", size);
   if (size > fat12.free_space) {
     printf("Error: not enough space on disk to store file.\n");
@@ -323,30 +783,26 @@ int main(int argc, char *argv[]) {
 
   ushort free_index = next_free_index(fat12.fat, 2);
   printf("Writing to Disk\n");
-  // write here, but the FAT table isn't written back to the disk until the
-  // end of the program, so if something goes wrong, the disk will be left in
-  // a consistent state, and the copied file can just be overwritten.
+  // write here, but the FAT table and directories aren't written back to the
+  // disk until the end of the program, so if something goes wrong, the disk
+  // will be left in a consistent state, and the copied file can just be
+  // overwritten.
   write_file(source, disk, fat12, free_index, size);
 
   dir_info_t dir_info = {
       .size = size, .first_cluster = free_index, .timestamp = time};
-  strncpy(dir_info.filename, filename, 13);
-
-  if (dir == 0x00) {
-    char dirpath[200];
-    strcpy(dirpath, filename);
-    add_to_tree(disk, source, fat12, dir_info, dirpath);
-  } else {
-    printf("Copying %s to subdirectory: %s\n", filename, dir);
-    char dirpath[200];
-    strcpy(dirpath, dir);
-    strcat(dirpath, "/");
-    strcat(dirpath, filename);
-    add_to_tree(disk, source, fat12, dir_info, dirpath);
-  }
+  name_from_83(name83, dir_info.filename);
+  set_entry(target, free_entry(&put, target), create_dir(dir_info));
+  printf("Added %s to %s.\n", dir_info.filename,
+         dir ? dir : "root directory");
 
   printf("Write Complete\nUpdating FAT Table\n");
-  write_to_disk(disk, fat12.fat.table, 512 * 1, fat12.fat.size, 1);
+  flush_sync(&put);
+  if (index_exists(args[0])) {
+    printf("Updating index\n");
+    build_index(disk, args[0]);
+  }
   free_fat12(fat12);
+  free(data);
   return 0;
 }
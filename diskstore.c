@@ -0,0 +1,87 @@
+/* Keeps disk images in a store that holds each distinct sector once (see
+ * store.h). Any of the other tools can read an image in the store through its
+ * manifest, e.g. ./disklist <STORE_DIR>/<NAME>.manifest, and export writes it
+ * back out as a plain image. */
+#include "store.h"
+#include <limits.h>
+#include <sys/time.h>
+
+double seconds() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return now.tv_sec + now.tv_usec / 1e6;
+}
+
+// stores the images under their file names, without the directory or .IMA.
+void import_images(char *store_dir, char **images, int num_images) {
+  double start = seconds();
+  long image_sectors = 0, stored = 0, added = 0, manifest_size = 0;
+  for (int i = 0; i < num_images; i++) {
+    char name[PATH_MAX];
+    char *base = strrchr(images[i], '/');
+    snprintf(name, PATH_MAX, "%s", base ? base + 1 : images[i]);
+    char *ext = strrchr(name, '.');
+    if (ext && ext != name) {
+      *ext = '\0';
+    }
+    import_stats_t stats = store_import(store_dir, images[i], name);
+    printf("Stored %s as %s%s: %u of %u sectors in use, %u new, %u runs.\n",
+           images[i], name, MANIFEST_SUFFIX, stats.stored, stats.num_sectors,
+           stats.added, stats.num_runs);
+    image_sectors += stats.num_sectors;
+    stored += stats.stored;
+    added += stats.added;
+    manifest_size +=
+        sizeof(manifest_header_t) + stats.num_runs * sizeof(manifest_run_t);
+  }
+  double elapsed = seconds() - start;
+  printf("Imported %d images (%ld KB) in %.2fs, %.1f MB/s.\n", num_images,
+         image_sectors * SECTOR_SIZE / 1024, elapsed,
+         image_sectors * SECTOR_SIZE / 1e6 / elapsed);
+  // what the images added to the store, against what they are.
+  long store_size = added * SECTOR_SIZE + manifest_size;
+  printf("They added %ld KB of sectors and %ld KB of manifests to the store",
+         added * SECTOR_SIZE / 1024, manifest_size / 1024);
+  if (store_size > 0) {
+    printf(", %.1f:1 deduplicated (%.1f:1 of the sectors in use)",
+           (double)image_sectors * SECTOR_SIZE / store_size,
+           (double)stored * SECTOR_SIZE / store_size);
+  }
+  printf(".\nThe pack holds %u sectors.\n", pack_sectors(store_dir));
+}
+
+void export_image(char *store_dir, char *name, char *out_name) {
+  char manifest[PATH_MAX];
+  snprintf(manifest, PATH_MAX, "%s/%s%s", store_dir, name, MANIFEST_SUFFIX);
+  FILE *disk = open_disk(manifest, "rb");
+  FILE *out = fopen(out_name, "wb");
+  if (out == NULL) {
+    printf("Error: could not create %s.\n", out_name);
+    exit(1);
+  }
+  byte buf[64 * SECTOR_SIZE];
+  int len;
+  while ((len = fread(buf, 1, sizeof(buf), disk)) > 0) {
+    if (fwrite(buf, 1, len, out) < len) {
+      printf("Error writing %s.\n", out_name);
+      exit(1);
+    }
+  }
+  if (ferror(disk) || fclose(out) != 0) {
+    printf("Error exporting %s.\n", name);
+    exit(1);
+  }
+  fclose(disk);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc >= 4 && strcmp(argv[2], "import") == 0) {
+    import_images(argv[1], argv + 3, argc - 3);
+  } else if (argc == 5 && strcmp(argv[2], "export") == 0) {
+    export_image(argv[1], argv[3], argv[4]);
+  } else {
+    printf("Usage: %s <STORE_DIR> import <IMAGE_NAME>.IMA...\n", argv[0]);
+    printf("       %s <STORE_DIR> export <NAME> <IMAGE_NAME>.IMA\n", argv[0]);
+    exit(1);
+  }
+}
@@ -1,15 +1,89 @@
 /* File containing utilites for interacting with fat12 disk images. */
 #include "fat12.h"
+#include <errno.h>
+#include <fcntl.h>
 
+// without open file description locks, fall back to process locks.
+#ifndef F_OFD_SETLKW
+#define F_OFD_SETLKW F_SETLKW
+#endif
+
+/* Takes (or with F_UNLCK, releases) one of the lock bytes of the image,
+ * waiting until it is free. If the filesystem doesn't support locks, the
+ * image is used without them. */
+void lock_byte(FILE *disk, int offset, short type) {
+  struct flock lock = {
+      .l_type = type, .l_whence = SEEK_SET, .l_start = offset, .l_len = 1};
+  while (fcntl(fileno(disk), F_OFD_SETLKW, &lock) != 0 && errno == EINTR) {
+  }
+}
+
+/* Opens the image, and locks it for reading or writing depending on attr.
+ * Readers go through the gate, so they wait while a commit is pending. */
 FILE *open_disk(char *filename, char *attr) {
+  if (is_manifest(filename)) {
+    return open_manifest(filename, attr);
+  }
   FILE *disk = fopen(filename, attr);
   if (disk == NULL) {
     printf("ERROR: Disk image %s does not exist\n", filename);
     exit(1);
   }
+  if (strchr(attr, '+') || strchr(attr, 'w')) {
+    lock_byte(disk, WRITER_LOCK, F_WRLCK);
+  } else {
+    lock_byte(disk, GATE_LOCK, F_RDLCK);
+    lock_byte(disk, METADATA_LOCK, F_RDLCK);
+    lock_byte(disk, GATE_LOCK, F_UNLCK);
+  }
   return disk;
 }
 
+/* Closes the gate to new readers, then waits for the current ones to finish.
+ * Everything written so far is flushed first, so the data a commit points
+ * at is in the image before the metadata is. */
+void lock_metadata(FILE *disk) {
+  fflush(disk);
+  lock_byte(disk, GATE_LOCK, F_WRLCK);
+  lock_byte(disk, METADATA_LOCK, F_WRLCK);
+}
+
+void unlock_metadata(FILE *disk) {
+  fflush(disk);
+  lock_byte(disk, METADATA_LOCK, F_UNLCK);
+  lock_byte(disk, GATE_LOCK, F_UNLCK);
+}
+
+void stat_disk(FILE *disk, struct stat *attr) {
+  if (fstat(fileno(disk), attr) != 0 && !stat_manifest(disk, attr)) {
+    printf("Error reading the size of the disk image.\n");
+    exit(1);
+  }
+}
+
+/* Maps the whole disk image into memory read-only, so regions of it can be
+ * compared or hashed in place. size is set to the size of the image. Images
+ * from a store can't be mapped, so they are read into anonymous memory. */
+byte *map_disk(FILE *disk, long *size) {
+  fseek(disk, 0, SEEK_END);
+  *size = ftell(disk);
+  byte *image;
+  if (fileno(disk) < 0) {
+    image = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (image != MAP_FAILED) {
+      read_from_disk(disk, image, 0, *size, 1);
+    }
+  } else {
+    image = mmap(NULL, *size, PROT_READ, MAP_SHARED, fileno(disk), 0);
+  }
+  if (image == MAP_FAILED) {
+    printf("Error mapping disk image.\n");
+    exit(1);
+  }
+  return image;
+}
+
 void read_from_disk(FILE *disk, void *buf, int address, int block_size,
                     int read_amt) {
   fseek(disk, address, SEEK_SET);
@@ -75,10 +149,22 @@ int should_skip_dir(directory_t dir) {
   }
 }
 
-directory_t read_dir(FILE *disk, int address) {
-  directory_t dir;
-  read_from_disk(disk, &dir, address, sizeof(directory_t), 1);
-  return dir;
+/* Filters "limit" raw directory entries (a multiple of 16), dropping free
+ * entries and . and .., into a new list. Anything after the end marker is
+ * zeroed. */
+directory_t *filter_dirs(directory_t *raw, int limit) {
+  directory_t *dir_list = calloc(limit, sizeof(directory_t));
+  dir_scan_t scans[limit / DIRS_PER_SECTOR];
+  int num_sectors = scan_dirs((byte *)raw, limit, scans);
+  int add_at = 0;
+  for (int i = 0; i < num_sectors; i++) {
+    // don't skip volume labels, because sometimes other functions need them.
+    uint16_t keep = scans[i].label | scans[i].dirs | scans[i].files;
+    for (; keep; keep &= keep - 1) {
+      dir_list[add_at++] = raw[i * DIRS_PER_SECTOR + __builtin_ctz(keep)];
+    }
+  }
+  return dir_list;
 }
 
 /* Allows reading "limit" amount of directory entries from the sector specified.
@@ -86,24 +172,10 @@ directory_t read_dir(FILE *disk, int address) {
  * exposed outside this file, only through wrapper functions that impose limits
  * on the number of directory entries that can be read. */
 directory_t *read_dirs(FILE *disk, int sector, int limit) {
-  directory_t *dir_list = malloc(limit * sizeof(directory_t));
-  int add_at = 0;
-  for (int i = 0; i < limit; i++) {
-    directory_t dir = read_dir(disk, sector * SECTOR_SIZE + i * DIR_SIZE);
-    switch (should_skip_dir(dir)) {
-    // only case 2 and 3 should be skipped. Don't skip volume lables,
-    // because sometimes other functions need them.
-    case 2:
-      continue;
-    case 3:
-      // zero out the rest of the array before exit, to make
-      // sure there are no garbage values leftover.
-      memset(dir_list + add_at, 0x00, (limit - i) * sizeof(directory_t));
-      return dir_list;
-    default:
-      dir_list[add_at++] = dir;
-    }
-  }
+  directory_t *raw = malloc(limit * sizeof(directory_t));
+  read_from_disk(disk, raw, sector * SECTOR_SIZE, sizeof(directory_t), limit);
+  directory_t *dir_list = filter_dirs(raw, limit);
+  free(raw);
   return dir_list;
 }
 
@@ -117,64 +189,76 @@ directory_t *root_dirs(FILE *disk) {
   return read_dirs(disk, ROOT, DIRS_IN_ROOT);
 }
 
-/* performs a complete filesystem traversal, counting every file encountered. */
-int count_files(FILE *disk, byte *fat_table, dir_list_t dirs) {
-  int num = 0, num_dirs = dirs.size;
-  directory_t *dir_list = dirs.dirs;
-  for (int i = 0; i < num_dirs; i++) {
-    directory_t dir = dir_list[i];
-    switch (should_skip_dir(dir)) {
-    case 1 ... 2:
-      continue;
-    case 3:
-      free(dir_list);
-      return num;
-    default:
-      if (dir.attribute & DIR_MASK) {
-        ushort index = bytes_to_ushort(dir.first_cluster);
-        if (index > 1) {
-          dir_list_t next_dirs = dir_from_fat(disk, fat_table, index);
-          num += count_files(disk, fat_table, next_dirs);
-        }
-      } else {
-        num++;
-      }
-    }
+// counts the clusters in the chain starting at index.
+int chain_length(byte *fat_table, int index) {
+  int num = 1;
+  while (!last_sector(index = fat_entry(fat_table, index), "chain_length")) {
+    num++;
   }
-  free(dirs.dirs);
   return num;
 }
 
-/* Creates a list of directory_t structs contained in the directory starting at
- * index in the FAT Table Reads all the directories from the sector into the
- * list, then recurses into the next sector. */
-dir_list_t dir_from_fat(FILE *disk, byte *fat_table, int index) {
-  ushort next_index = fat_entry(fat_table, index);
-  int sector_num = index + SECTOR_OFFSET;
-
-  directory_t *dirs = sector_dirs(disk, sector_num);
-  if (last_sector(next_index, "dir_from_fat")) {
-    // a directory can hold 16 subdirectories,
-    // but 2 will always be . and .., so only
-    // 14 are available.
-    dir_list_t dir_list = {.dirs = dirs, .size = 14};
-    return dir_list;
+/* Walks up to max_clusters clusters along the chain from *index, adding a read
+ * request to reqs for each run of consecutive clusters, reading into buf in
+ * chain order. Leaves *index at the next cluster in the chain, and returns
+ * the number of requests added. */
+int chain_reads(byte *fat_table, int *index, int max_clusters, byte *buf,
+                read_req_t *reqs) {
+  int num_reqs = 0, prev = -1;
+  for (int i = 0; i < max_clusters && *index < LAST_SECTOR; i++) {
+    if (*index == prev + 1) {
+      reqs[num_reqs - 1].len += SECTOR_SIZE;
+    } else {
+      read_req_t req = {.buf = buf + i * SECTOR_SIZE,
+                        .offset = (long)(*index + SECTOR_OFFSET) * SECTOR_SIZE,
+                        .len = SECTOR_SIZE};
+      reqs[num_reqs++] = req;
+    }
+    prev = *index;
+    *index = fat_entry(fat_table, *index);
+    last_sector(*index, "chain_reads");
   }
+  return num_reqs;
+}
 
-  dir_list_t next_dir_list = dir_from_fat(disk, fat_table, next_index);
-
-  // combine the two lists. Only 14 directries will be added
-  // to the list, because the other two are . and ..
-  dir_list_t dir_list = {.size = 14 + next_dir_list.size};
-
-  dir_list.dirs = malloc(dir_list.size * sizeof(directory_t));
-
-  memcpy(dir_list.dirs, dirs, 14 * sizeof(directory_t));
-  memcpy(dir_list.dirs + 14, next_dir_list.dirs,
-         next_dir_list.size * sizeof(directory_t));
+/* Reads every sector of each of the num_dirs directories starting at the
+ * clusters given, all in one batch. Returns a buffer for each directory, with
+ * its number of entries in sizes. */
+byte **read_dir_batch(FILE *disk, byte *fat_table, ushort *clusters,
+                      int num_dirs, int *sizes) {
+  byte **bufs = malloc(num_dirs * sizeof(byte *));
+  int total = 0;
+  for (int i = 0; i < num_dirs; i++) {
+    int length = chain_length(fat_table, clusters[i]);
+    bufs[i] = malloc(length * SECTOR_SIZE * sizeof(byte));
+    sizes[i] = length * DIRS_PER_SECTOR;
+    total += length;
+  }
+  read_req_t *reqs = malloc(total * sizeof(read_req_t));
+  int num_reqs = 0;
+  for (int i = 0; i < num_dirs; i++) {
+    int index = clusters[i];
+    num_reqs += chain_reads(fat_table, &index, sizes[i] / DIRS_PER_SECTOR,
+                            bufs[i], reqs + num_reqs);
+  }
+  read_batch(disk, reqs, num_reqs);
+  free(reqs);
+  return bufs;
+}
 
-  free(dirs);
-  free(next_dir_list.dirs);
+/* Creates a list of directory_t structs contained in the directory starting at
+ * index in the FAT Table. All the sectors in the chain are read together, then
+ * the entries from every sector are filtered into the list together. */
+dir_list_t dir_from_fat(FILE *disk, byte *fat_table, int index) {
+  ushort cluster = index;
+  int size;
+  byte **bufs = read_dir_batch(disk, fat_table, &cluster, 1, &size);
+  // . and .. are filtered out, so only the first sector
+  // has 2 fewer entries than it can hold.
+  dir_list_t dir_list = {.dirs = filter_dirs((directory_t *)bufs[0], size),
+                         .size = size};
+  free(bufs[0]);
+  free(bufs);
   return dir_list;
 }
 
@@ -205,20 +289,49 @@ char *filename_ext(directory_t dir) {
   return filename;
 }
 
+/* Builds a bitmap with a bit set for each free entry in the first num_entries
+ * entries of the FAT table. Decodes two 12-bit entries out of every 3 bytes,
+ * instead of calling fat_entry for each one. */
+uint64_t *free_map(byte *fat_table, int num_entries) {
+  uint64_t *map = calloc((num_entries + 63) / 64, sizeof(uint64_t));
+  for (int n = 0; n < num_entries; n += 2) {
+    byte *b = fat_table + 3 * n / 2;
+    uint pair = b[0] | (b[1] << 8) | (b[2] << 16);
+    map[n / 64] |= (uint64_t)((pair & 0xFFF) == 0) << (n % 64);
+    if (n + 1 < num_entries) {
+      map[(n + 1) / 64] |= (uint64_t)((pair >> 12) == 0) << ((n + 1) % 64);
+    }
+  }
+  return map;
+}
+
+// counts the bits set in the map, a word at a time.
+int count_free(uint64_t *map, int num_entries) {
+  int num = 0;
+  for (int i = 0; i < (num_entries + 63) / 64; i++) {
+    num += __builtin_popcountll(map[i]);
+  }
+  return num;
+}
+
 int free_space(byte *fat_table, int num_sectors) {
-  int free_sectors = 0;
+  uint64_t *map = free_map(fat_table, num_sectors);
+  int free_sectors = count_free(map, num_sectors);
+  free(map);
   // the first 2 entries in the fat table are reserved,
   // and there are 32 sectors that are not available for
   // data storage which should be excluded.
-  for (int i = 0; i < num_sectors; i++) {
-    free_sectors += (fat_entry(fat_table, i) == 0x000);
-  }
   return (free_sectors - 32) * SECTOR_SIZE;
 }
 
-fat12_t fat12_from_file(FILE *disk) {
+byte *read_boot_sector(FILE *disk) {
   byte *boot_sector = malloc(SECTOR_SIZE * sizeof(byte));
   read_from_disk(disk, boot_sector, 0, SECTOR_SIZE, 1);
+  return boot_sector;
+}
+
+fat12_t fat12_from_file(FILE *disk) {
+  byte *boot_sector = read_boot_sector(disk);
 
   directory_t *root = root_dirs(disk);
   fat_table_t fat = fat_table(disk, boot_sector);
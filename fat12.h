@@ -1,4 +1,7 @@
-#include "byte.h"
+#include "aio.h"
+#include "scan.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define ROOT 19
 #define ROOT_DIR_SIZE (14 * 512)
@@ -61,17 +64,49 @@ typedef struct fat12_t {
   uint total_size;
 } fat12_t;
 
+/* Images are shared between processes with advisory locks on single bytes
+ * that stand for the locks, not for the data in them. Readers hold the
+ * metadata lock shared for as long as the image is open. Writers hold the
+ * writer lock the whole time, so only one of them allocates clusters at a
+ * time, and write file data to free clusters no reader can reach. They take
+ * the metadata lock exclusively only to commit the FAT and directories. */
+#define METADATA_LOCK 0
+#define WRITER_LOCK 1
+#define GATE_LOCK 2
+
+void lock_byte(FILE *disk, int offset, short type);
+// opening with "r" takes the lock for reading, with "+" or "w" for writing.
 FILE *open_disk(char *filename, char *attr);
+// the size and modified time of the image, wherever it is opened from.
+void stat_disk(FILE *disk, struct stat *attr);
+void lock_metadata(FILE *disk);
+void unlock_metadata(FILE *disk);
+byte *map_disk(FILE *disk, long *size);
+void read_from_disk(FILE *disk, void *buf, int address, int block_size,
+                    int read_amt);
 
 ushort fat_entry(byte *fat_table, int n);
 
+/* Images in a store (see store.h) are opened from their manifest. They have
+ * no file descriptor, so they are only read through the FILE. */
+int is_manifest(char *path);
+FILE *open_manifest(char *manifest, char *attr);
+int stat_manifest(FILE *disk, struct stat *attr);
+
 byte *read_sector(FILE *disk, int sector_num);
 
 // functions for various filesystem actions.
 void copy_file(FILE *src_disk, FILE *out, byte *fat_table, int index, int size);
-int count_files(FILE *disk, byte *fat_table, dir_list_t dirs);
+int count_files(FILE *disk, byte *fat_table);
 dir_list_t dir_from_fat(FILE *disk, byte *fat_table, int index);
 
+// cluster chains are read in batches of requests, see aio.h.
+int chain_length(byte *fat_table, int index);
+int chain_reads(byte *fat_table, int *index, int max_clusters, byte *buf,
+                read_req_t *reqs);
+byte **read_dir_batch(FILE *disk, byte *fat_table, ushort *clusters,
+                      int num_dirs, int *sizes);
+
 int should_skip_dir(directory_t dir);
 
 int last_sector(int index, char *exit_msg);
@@ -80,7 +115,15 @@ int last_sector(int index, char *exit_msg);
 // of a directory entry into a single string.
 char *filename_ext(directory_t dir);
 
+// free space is counted from a bitmap of the free FAT entries.
+uint64_t *free_map(byte *fat_table, int num_entries);
+int count_free(uint64_t *map, int num_entries);
 int free_space(byte *fat_table, int num_sectors);
 
+// the boot sector and FAT can be read on their own, for callers
+// that don't need everything fat12_from_file reads.
+byte *read_boot_sector(FILE *disk);
+fat_table_t fat_table(FILE *disk, byte *boot_sector);
+
 fat12_t fat12_from_file(FILE *disk);
 void free_fat12(fat12_t fat12);
@@ -0,0 +1,311 @@
+/* Builds, validates and maps the sidecar index files of disk images. */
+#include "index.h"
+#include <limits.h>
+
+void index_path(char *image, char *path) {
+  char *dir = getenv("FAT12_INDEX_DIR");
+  if (dir) {
+    char *base = strrchr(image, '/');
+    snprintf(path, PATH_MAX, "%s/%s.idx", dir, base ? base + 1 : image);
+  } else {
+    snprintf(path, PATH_MAX, "%s.idx", image);
+  }
+}
+
+int index_exists(char *image) {
+  char path[PATH_MAX];
+  index_path(image, path);
+  return access(path, F_OK) == 0;
+}
+
+// hash of the boot sector, FATs and root directory.
+uint64_t meta_hash(FILE *disk) {
+  int size = (SECTOR_OFFSET + 2) * SECTOR_SIZE;
+  byte *meta = malloc(size * sizeof(byte));
+  read_from_disk(disk, meta, 0, size, 1);
+  uint64_t hash = hash_bytes(meta, size);
+  free(meta);
+  return hash;
+}
+
+typedef struct builder_t {
+  index_dir_t *dirs;
+  int num_dirs, dirs_cap;
+  index_entry_t *entries;
+  int num_entries, entries_cap;
+  index_extent_t *extents;
+  int num_extents, extents_cap;
+  char *paths;
+  int paths_size, paths_cap;
+  int num_files;
+} builder_t;
+
+// makes room for n more elements of size in the array, doubling its capacity.
+void *grow(void *array, int *cap, int len, int n, int size) {
+  if (len + n > *cap) {
+    while (len + n > *cap) {
+      *cap = *cap ? *cap * 2 : 64;
+    }
+    array = realloc(array, *cap * size);
+  }
+  return array;
+}
+
+uint32_t add_path(builder_t *b, char *path) {
+  int len = strlen(path) + 1;
+  b->paths = grow(b->paths, &b->paths_cap, b->paths_size, len, 1);
+  memcpy(b->paths + b->paths_size, path, len);
+  b->paths_size += len;
+  return b->paths_size - len;
+}
+
+// adds an extent for each run of consecutive clusters in the chain.
+void add_extents(builder_t *b, byte *fat_table, int index,
+                 index_entry_t *entry) {
+  entry->first_extent = b->num_extents;
+  entry->num_extents = 0;
+  for (int prev = -1; index > 1 && index < LAST_SECTOR;
+       index = fat_entry(fat_table, index)) {
+    if (index == prev + 1) {
+      b->extents[b->num_extents - 1].count++;
+    } else {
+      b->extents =
+          grow(b->extents, &b->extents_cap, b->num_extents, 1,
+               sizeof(index_extent_t));
+      index_extent_t extent = {.start = index, .count = 1};
+      b->extents[b->num_extents++] = extent;
+      entry->num_extents++;
+    }
+    prev = index;
+  }
+}
+
+/* Adds the directory and its entries, then each of its subdirectories in
+ * turn, so directories end up in the order disklist prints them. Returns
+ * the directory's index in the dirs table. */
+uint32_t add_dir(builder_t *b, FILE *disk, byte *fat_table, dir_list_t list,
+                 char *path) {
+  b->dirs = grow(b->dirs, &b->dirs_cap, b->num_dirs, 1, sizeof(index_dir_t));
+  int d = b->num_dirs++;
+  index_dir_t dir = {.path = add_path(b, path),
+                     .first_entry = b->num_entries,
+                     .num_entries = 0};
+  for (int i = 0; i < list.size; i++) {
+    int skip = should_skip_dir(list.dirs[i]);
+    if (skip == 3) {
+      break;
+    } else if (skip != 0) {
+      continue;
+    }
+    char entry_path[200];
+    char *filename = filename_ext(list.dirs[i]);
+    snprintf(entry_path, 200, "%s%s%s", path, *path ? "/" : "", filename);
+    free(filename);
+    b->entries = grow(b->entries, &b->entries_cap, b->num_entries, 1,
+                      sizeof(index_entry_t));
+    index_entry_t *entry = b->entries + b->num_entries++;
+    entry->dir = list.dirs[i];
+    entry->path = add_path(b, entry_path);
+    entry->child_dir = NO_DIR;
+    add_extents(b, fat_table, bytes_to_ushort(list.dirs[i].first_cluster),
+                entry);
+    b->num_files += !(list.dirs[i].attribute & DIR_MASK);
+    dir.num_entries++;
+  }
+  b->dirs[d] = dir;
+
+  for (int i = dir.first_entry; i < dir.first_entry + dir.num_entries; i++) {
+    directory_t entry = b->entries[i].dir;
+    if (entry.attribute & DIR_MASK) {
+      char entry_path[200];
+      strncpy(entry_path, b->paths + b->entries[i].path, 200);
+      dir_list_t next_dirs =
+          dir_from_fat(disk, fat_table, bytes_to_ushort(entry.first_cluster));
+      uint32_t child = add_dir(b, disk, fat_table, next_dirs, entry_path);
+      b->entries[i].child_dir = child;
+      free(next_dirs.dirs);
+    }
+  }
+  return d;
+}
+
+// offset of the end of a table, rounded up to keep the next table aligned.
+uint32_t table_end(uint32_t offset, int len, int size) {
+  return (offset + len * size + 7) & ~7;
+}
+
+/* Builds the index for the image from scratch in anonymous memory, so it can
+ * be used just like a mapped index file. Sets size to its length. */
+byte *index_image(FILE *disk, long *size) {
+  fflush(disk);
+  fat12_t fat12 = fat12_from_file(disk);
+  builder_t b;
+  memset(&b, 0, sizeof(builder_t));
+  add_dir(&b, disk, fat12.fat.table, fat12.root, "");
+
+  struct stat attr;
+  stat_disk(disk, &attr);
+  index_header_t header;
+  memset(&header, 0, sizeof(index_header_t));
+  memcpy(header.magic, INDEX_MAGIC, 8);
+  header.version = INDEX_VERSION;
+  header.num_clusters = fat12.num_sectors - SECTOR_OFFSET;
+  if (header.num_clusters > fat12.fat.size * 2 / 3) {
+    header.num_clusters = fat12.fat.size * 2 / 3;
+  }
+  header.image_size = attr.st_size;
+  header.image_mtime_ns =
+      attr.st_mtim.tv_sec * 1000000000LL + attr.st_mtim.tv_nsec;
+  header.meta_hash = meta_hash(disk);
+  header.free_space = fat12.free_space;
+  header.num_files = b.num_files;
+  header.num_dirs = b.num_dirs;
+  header.num_entries = b.num_entries;
+  header.num_extents = b.num_extents;
+  header.paths_size = b.paths_size;
+  header.fat_offset = table_end(0, 1, sizeof(index_header_t));
+  header.dirs_offset =
+      table_end(header.fat_offset, header.num_clusters, sizeof(uint16_t));
+  header.entries_offset =
+      table_end(header.dirs_offset, b.num_dirs, sizeof(index_dir_t));
+  header.extents_offset =
+      table_end(header.entries_offset, b.num_entries, sizeof(index_entry_t));
+  header.paths_offset =
+      table_end(header.extents_offset, b.num_extents, sizeof(index_extent_t));
+
+  *size = header.paths_offset + b.paths_size;
+  byte *out = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  memcpy(out, &header, sizeof(index_header_t));
+  uint16_t *fat = (uint16_t *)(out + header.fat_offset);
+  for (int i = 0; i < header.num_clusters; i++) {
+    fat[i] = fat_entry(fat12.fat.table, i);
+  }
+  memcpy(out + header.dirs_offset, b.dirs, b.num_dirs * sizeof(index_dir_t));
+  memcpy(out + header.entries_offset, b.entries,
+         b.num_entries * sizeof(index_entry_t));
+  memcpy(out + header.extents_offset, b.extents,
+         b.num_extents * sizeof(index_extent_t));
+  memcpy(out + header.paths_offset, b.paths, b.paths_size);
+  free(b.dirs);
+  free(b.entries);
+  free(b.extents);
+  free(b.paths);
+  free_fat12(fat12);
+  return out;
+}
+
+/* Builds the index for the image from scratch and writes it, replacing any
+ * existing index in one rename. Returns 0 if it couldn't be written, e.g. to
+ * a read-only directory, leaving the old index as it was. */
+int write_index(FILE *disk, char *image) {
+  long size;
+  byte *out = index_image(disk, &size);
+
+  // readers rebuilding a stale index at the same time each write their own.
+  char path[PATH_MAX], tmp_path[PATH_MAX + 16];
+  index_path(image, path);
+  snprintf(tmp_path, PATH_MAX + 16, "%s.%d.tmp", path, getpid());
+  FILE *index_file = fopen(tmp_path, "wb");
+  int written = 0;
+  if (index_file != NULL) {
+    written = fwrite(out, size, 1, index_file) == 1;
+    if (fclose(index_file) != 0 || !written || rename(tmp_path, path) != 0) {
+      unlink(tmp_path);
+      written = 0;
+    }
+  }
+  munmap(out, size);
+  return written;
+}
+
+void build_index(FILE *disk, char *image) {
+  if (!write_index(disk, image)) {
+    char path[PATH_MAX];
+    index_path(image, path);
+    printf("Error: could not write index %s.\n", path);
+    exit(1);
+  }
+}
+
+// points the index at each of the tables in its map.
+void find_tables(index_t *index) {
+  index_header_t *header = index->header;
+  index->fat = (uint16_t *)(index->map + header->fat_offset);
+  index->dirs = (index_dir_t *)(index->map + header->dirs_offset);
+  index->entries = (index_entry_t *)(index->map + header->entries_offset);
+  index->extents = (index_extent_t *)(index->map + header->extents_offset);
+  index->paths = (char *)(index->map + header->paths_offset);
+}
+
+/* Maps the index at path, if it matches the image. Returns 0 if it is
+ * missing, unreadable or stale. */
+int open_index(FILE *disk, char *path, index_t *index) {
+  FILE *index_file = fopen(path, "rb");
+  if (index_file == NULL) {
+    return 0;
+  }
+  fseek(index_file, 0, SEEK_END);
+  if (ftell(index_file) < sizeof(index_header_t)) {
+    fclose(index_file);
+    return 0;
+  }
+  index->map = map_disk(index_file, &index->size);
+  fclose(index_file);
+  index_header_t *header = (index_header_t *)index->map;
+  index->header = header;
+
+  struct stat attr;
+  fflush(disk);
+  stat_disk(disk, &attr);
+  if (memcmp(header->magic, INDEX_MAGIC, 8) != 0 ||
+      header->version != INDEX_VERSION ||
+      header->paths_offset + header->paths_size > index->size ||
+      header->image_size != attr.st_size ||
+      header->image_mtime_ns !=
+          attr.st_mtim.tv_sec * 1000000000LL + attr.st_mtim.tv_nsec ||
+      header->meta_hash != meta_hash(disk)) {
+    close_index(index);
+    return 0;
+  }
+  find_tables(index);
+  return 1;
+}
+
+/* Maps the image's index, rebuilding it first if it is stale. Returns 0 if
+ * the image has no index, or a stale one that can't be rewritten, in which
+ * case the image has to be read instead. */
+int load_index(FILE *disk, char *image, index_t *index) {
+  char path[PATH_MAX];
+  index_path(image, path);
+  if (access(path, F_OK) != 0) {
+    return 0;
+  }
+  if (open_index(disk, path, index)) {
+    return 1;
+  }
+  return write_index(disk, image) && open_index(disk, path, index);
+}
+
+/* Builds an index of the image in memory, for when it doesn't have an index
+ * file. It is closed with close_index all the same. */
+void memory_index(FILE *disk, index_t *index) {
+  index->map = index_image(disk, &index->size);
+  index->header = (index_header_t *)index->map;
+  find_tables(index);
+}
+
+void close_index(index_t *index) { munmap(index->map, index->size); }
+
+// finds the entry in the directory with the file name given.
+index_entry_t *index_find(index_t *index, index_dir_t *dir, char *name) {
+  for (int i = 0; i < dir->num_entries; i++) {
+    index_entry_t *entry = index->entries + dir->first_entry + i;
+    char *path = index->paths + entry->path;
+    char *filename = strrchr(path, '/');
+    if (strcmp(filename ? filename + 1 : path, name) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
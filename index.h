@@ -0,0 +1,80 @@
+/* Header file for index.c, which keeps a sidecar index file of the decoded
+ * metadata of a disk image, so repeat queries don't have to re-read the FAT
+ * and walk the directory tree. The index lives next to the image as
+ * <IMAGE>.idx, or in $FAT12_INDEX_DIR if that is set, and is only used if
+ * it already exists. (diskindex creates one, and disk2tar builds one in
+ * memory when there isn't one.) */
+#include "fat12.h"
+#include <sys/stat.h>
+
+#define INDEX_MAGIC "FAT12IDX"
+#define INDEX_VERSION 1
+#define NO_DIR 0xFFFFFFFF
+
+/* The index file is this header followed by the tables it gives the offsets
+ * of, all fixed size records, so it can be used mapped in place. It is valid
+ * while the image size, mtime and hash of its metadata region all match. */
+typedef struct index_header_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_clusters;
+  int64_t image_size;
+  int64_t image_mtime_ns;
+  uint64_t meta_hash;
+  uint32_t free_space;
+  uint32_t num_files;
+  uint32_t num_dirs;
+  uint32_t num_entries;
+  uint32_t num_extents;
+  uint32_t paths_size;
+  // byte offsets of each table from the start of the file.
+  uint32_t fat_offset;
+  uint32_t dirs_offset;
+  uint32_t entries_offset;
+  uint32_t extents_offset;
+  uint32_t paths_offset;
+} index_header_t;
+
+/* Directories are in the order disklist visits them, root first, and the
+ * entries of each directory are contiguous. Paths are offsets into the path
+ * table, e.g "SUB1/SUB2", with "" for the root directory. */
+typedef struct index_dir_t {
+  uint32_t path;
+  uint32_t first_entry;
+  uint32_t num_entries;
+} index_dir_t;
+
+typedef struct index_entry_t {
+  directory_t dir;
+  uint32_t path;
+  uint32_t first_extent;
+  uint32_t num_extents;
+  uint32_t child_dir; // index into the dirs table, NO_DIR for files.
+} index_entry_t;
+
+// a run of consecutive clusters.
+typedef struct index_extent_t {
+  uint16_t start;
+  uint16_t count;
+} index_extent_t;
+
+typedef struct index_t {
+  byte *map;
+  long size;
+  index_header_t *header;
+  uint16_t *fat;
+  index_dir_t *dirs;
+  index_entry_t *entries;
+  index_extent_t *extents;
+  char *paths;
+} index_t;
+
+int index_exists(char *image);
+int write_index(FILE *disk, char *image);
+// writes the index like write_index, but exits if it can't.
+void build_index(FILE *disk, char *image);
+int load_index(FILE *disk, char *image, index_t *index);
+void memory_index(FILE *disk, index_t *index);
+void close_index(index_t *index);
+
+index_entry_t *index_find(index_t *index, index_dir_t *dir, char *name);
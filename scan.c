@@ -0,0 +1,236 @@
+/* Classifies the entries of directory sectors in bulk. The SIMD versions
+ * rearrange the entries so each vector lane holds the same 4 bytes of a
+ * different entry, then check every entry with one compare. */
+#include "fat12.h"
+
+// make SCALAR_SCAN=1 leaves out the SIMD versions.
+#if defined(__SSE2__) && !defined(SCALAR_SCAN)
+#include <immintrin.h>
+#define SCAN_SIMD
+#endif
+
+// the checks for each entry of a sector, before the end marker is applied.
+typedef struct raw_scan_t {
+  uint16_t end;
+  uint16_t deleted;
+  uint16_t label;
+  uint16_t dots;
+  uint16_t dir;
+  uint16_t no_cluster;
+} raw_scan_t;
+
+/* The same checks as should_skip_dir, for every entry of the sector. (An entry
+ * starting with a space counts as . or .. there too.) Like the SIMD versions,
+ * it stops after the end marker, since nothing after it is used. */
+raw_scan_t scan_scalar(byte *sector) {
+  raw_scan_t raw = {0};
+  for (int i = 0; i < DIRS_PER_SECTOR; i++) {
+    directory_t *dir = (directory_t *)(sector + i * DIR_SIZE);
+    byte *name = dir->filename;
+    uint16_t bit = 1 << i;
+    raw.end |= (name[0] == 0x00) ? bit : 0;
+    raw.deleted |= (name[0] == FILE_FREE) ? bit : 0;
+    raw.label |= (dir->attribute == LABEL_MASK) ? bit : 0;
+    raw.dir |= (dir->attribute & DIR_MASK) ? bit : 0;
+    raw.no_cluster |= (bytes_to_ushort(dir->first_cluster) <= 1) ? bit : 0;
+    raw.dots |= (name[0] == 0x20 || (name[0] == DOT && name[1] == 0x20) ||
+                 (name[0] == DOT && name[1] == DOT && name[2] == 0x20))
+                    ? bit
+                    : 0;
+    if (raw.end) {
+      break;
+    }
+  }
+  return raw;
+}
+
+uint16_t name_scalar(byte *sector, byte *name83) {
+  uint16_t match = 0;
+  for (int i = 0; i < DIRS_PER_SECTOR; i++) {
+    match |= (memcmp(sector + i * DIR_SIZE, name83, 11) == 0) << i;
+  }
+  return match;
+}
+
+#ifdef SCAN_SIMD
+#define MASK4(v) _mm_movemask_ps(_mm_castsi128_ps(v))
+#define MASK8(v) _mm256_movemask_ps(_mm256_castsi256_ps(v))
+
+/* Transposes 4 entries so w[0], w[1], w[2] hold bytes 0-3, 4-7 and 8-11 (the
+ * name, extension and attribute) and w[3] bytes 24-27 (the first cluster in
+ * the upper half) of each entry. */
+void lanes_sse2(byte *entries, __m128i *w) {
+  __m128i a[4], b[4];
+  for (int i = 0; i < 4; i++) {
+    a[i] = _mm_loadu_si128((__m128i *)(entries + i * DIR_SIZE));
+    b[i] = _mm_loadu_si128((__m128i *)(entries + i * DIR_SIZE + 16));
+  }
+  __m128i lo01 = _mm_unpacklo_epi32(a[0], a[1]);
+  __m128i lo23 = _mm_unpacklo_epi32(a[2], a[3]);
+  __m128i hi01 = _mm_unpackhi_epi32(a[0], a[1]);
+  __m128i hi23 = _mm_unpackhi_epi32(a[2], a[3]);
+  __m128i b01 = _mm_unpackhi_epi32(b[0], b[1]);
+  __m128i b23 = _mm_unpackhi_epi32(b[2], b[3]);
+  w[0] = _mm_unpacklo_epi64(lo01, lo23);
+  w[1] = _mm_unpackhi_epi64(lo01, lo23);
+  w[2] = _mm_unpacklo_epi64(hi01, hi23);
+  w[3] = _mm_unpacklo_epi64(b01, b23);
+}
+
+raw_scan_t scan_sse2(byte *sector) {
+  raw_scan_t raw = {0};
+  __m128i zero = _mm_setzero_si128(), w[4];
+  for (int i = 0; i < DIRS_PER_SECTOR; i += 4) {
+    lanes_sse2(sector + i * DIR_SIZE, w);
+    __m128i first = _mm_and_si128(w[0], _mm_set1_epi32(0xFF));
+    __m128i attr = _mm_srli_epi32(w[2], 24);
+    __m128i dir = _mm_and_si128(attr, _mm_set1_epi32(DIR_MASK));
+    __m128i cluster = _mm_srli_epi32(w[3], 17);
+    __m128i dots = _mm_or_si128(
+        _mm_cmpeq_epi32(first, _mm_set1_epi32(0x20)),
+        _mm_or_si128(
+            _mm_cmpeq_epi32(_mm_and_si128(w[0], _mm_set1_epi32(0xFFFF)),
+                            _mm_set1_epi32(0x202E)),
+            _mm_cmpeq_epi32(_mm_and_si128(w[0], _mm_set1_epi32(0xFFFFFF)),
+                            _mm_set1_epi32(0x202E2E))));
+    raw.end |= MASK4(_mm_cmpeq_epi32(first, zero)) << i;
+    raw.deleted |= MASK4(_mm_cmpeq_epi32(first, _mm_set1_epi32(FILE_FREE)))
+                   << i;
+    raw.label |= MASK4(_mm_cmpeq_epi32(attr, _mm_set1_epi32(LABEL_MASK))) << i;
+    raw.dir |= MASK4(_mm_cmpeq_epi32(dir, _mm_set1_epi32(DIR_MASK))) << i;
+    raw.no_cluster |= MASK4(_mm_cmpeq_epi32(cluster, zero)) << i;
+    raw.dots |= MASK4(dots) << i;
+    if (raw.end) {
+      break;
+    }
+  }
+  return raw;
+}
+
+uint16_t name_sse2(byte *sector, byte *name83) {
+  uint32_t name[3] = {0};
+  memcpy(name, name83, 11);
+  uint16_t match = 0;
+  __m128i w[4];
+  for (int i = 0; i < DIRS_PER_SECTOR; i += 4) {
+    lanes_sse2(sector + i * DIR_SIZE, w);
+    __m128i ext = _mm_and_si128(w[2], _mm_set1_epi32(0xFFFFFF));
+    __m128i eq = _mm_and_si128(
+        _mm_and_si128(_mm_cmpeq_epi32(w[0], _mm_set1_epi32(name[0])),
+                      _mm_cmpeq_epi32(w[1], _mm_set1_epi32(name[1]))),
+        _mm_cmpeq_epi32(ext, _mm_set1_epi32(name[2])));
+    match |= MASK4(eq) << i;
+  }
+  return match;
+}
+
+/* The AVX2 versions gather the same words of 8 entries at once, rather than
+ * transposing them. They're only called when the CPU supports AVX2. */
+__attribute__((target("avx2"))) void lanes_avx2(byte *entries, __m256i *w) {
+  __m256i index = _mm256_setr_epi32(0, 8, 16, 24, 32, 40, 48, 56);
+  w[0] = _mm256_i32gather_epi32((int *)entries, index, 4);
+  w[1] = _mm256_i32gather_epi32((int *)(entries + 4), index, 4);
+  w[2] = _mm256_i32gather_epi32((int *)(entries + 8), index, 4);
+  w[3] = _mm256_i32gather_epi32((int *)(entries + 24), index, 4);
+}
+
+__attribute__((target("avx2"))) raw_scan_t scan_avx2(byte *sector) {
+  raw_scan_t raw = {0};
+  __m256i zero = _mm256_setzero_si256(), w[4];
+  for (int i = 0; i < DIRS_PER_SECTOR; i += 8) {
+    lanes_avx2(sector + i * DIR_SIZE, w);
+    __m256i first = _mm256_and_si256(w[0], _mm256_set1_epi32(0xFF));
+    __m256i attr = _mm256_srli_epi32(w[2], 24);
+    __m256i dir = _mm256_and_si256(attr, _mm256_set1_epi32(DIR_MASK));
+    __m256i cluster = _mm256_srli_epi32(w[3], 17);
+    __m256i dots = _mm256_or_si256(
+        _mm256_cmpeq_epi32(first, _mm256_set1_epi32(0x20)),
+        _mm256_or_si256(
+            _mm256_cmpeq_epi32(
+                _mm256_and_si256(w[0], _mm256_set1_epi32(0xFFFF)),
+                _mm256_set1_epi32(0x202E)),
+            _mm256_cmpeq_epi32(
+                _mm256_and_si256(w[0], _mm256_set1_epi32(0xFFFFFF)),
+                _mm256_set1_epi32(0x202E2E))));
+    raw.end |= MASK8(_mm256_cmpeq_epi32(first, zero)) << i;
+    raw.deleted |=
+        MASK8(_mm256_cmpeq_epi32(first, _mm256_set1_epi32(FILE_FREE))) << i;
+    raw.label |= MASK8(_mm256_cmpeq_epi32(attr, _mm256_set1_epi32(LABEL_MASK)))
+                 << i;
+    raw.dir |= MASK8(_mm256_cmpeq_epi32(dir, _mm256_set1_epi32(DIR_MASK))) << i;
+    raw.no_cluster |= MASK8(_mm256_cmpeq_epi32(cluster, zero)) << i;
+    raw.dots |= MASK8(dots) << i;
+    if (raw.end) {
+      break;
+    }
+  }
+  return raw;
+}
+
+__attribute__((target("avx2"))) uint16_t name_avx2(byte *sector,
+                                                   byte *name83) {
+  uint32_t name[3] = {0};
+  memcpy(name, name83, 11);
+  uint16_t match = 0;
+  __m256i w[4];
+  for (int i = 0; i < DIRS_PER_SECTOR; i += 8) {
+    lanes_avx2(sector + i * DIR_SIZE, w);
+    __m256i ext = _mm256_and_si256(w[2], _mm256_set1_epi32(0xFFFFFF));
+    __m256i eq = _mm256_and_si256(
+        _mm256_and_si256(_mm256_cmpeq_epi32(w[0], _mm256_set1_epi32(name[0])),
+                         _mm256_cmpeq_epi32(w[1], _mm256_set1_epi32(name[1]))),
+        _mm256_cmpeq_epi32(ext, _mm256_set1_epi32(name[2])));
+    match |= MASK8(eq) << i;
+  }
+  return match;
+}
+#endif
+
+raw_scan_t scan_sector(byte *sector) {
+#ifdef SCAN_SIMD
+  return __builtin_cpu_supports("avx2") ? scan_avx2(sector)
+                                        : scan_sse2(sector);
+#else
+  return scan_scalar(sector);
+#endif
+}
+
+uint16_t scan_name(byte *sector, byte *name83) {
+#ifdef SCAN_SIMD
+  return __builtin_cpu_supports("avx2") ? name_avx2(sector, name83)
+                                        : name_sse2(sector, name83);
+#else
+  return name_scalar(sector, name83);
+#endif
+}
+
+/* Turns the checks into the masks, in the same order should_skip_dir goes:
+ * nothing counts from the end marker on, deleted entries aren't used, and
+ * labels, entries without a cluster, and . and .. aren't files or dirs. */
+dir_scan_t finish_scan(raw_scan_t raw) {
+  uint16_t before_end = raw.end ? (raw.end & -raw.end) - 1 : 0xFFFF;
+  dir_scan_t scan = {.end = ~before_end};
+  scan.used = before_end & ~raw.deleted;
+  scan.label = scan.used & raw.label;
+  scan.dots = scan.used & ~raw.label & raw.dots;
+  uint16_t live = scan.used & ~raw.label & ~raw.no_cluster & ~raw.dots;
+  scan.dirs = live & raw.dir;
+  scan.files = live & ~raw.dir;
+  return scan;
+}
+
+int scan_dirs(byte *buf, int num_entries, dir_scan_t *scans) {
+  int num_sectors = num_entries / DIRS_PER_SECTOR, scanned = num_sectors;
+  for (int i = 0; i < num_sectors; i++) {
+    if (scanned < num_sectors) {
+      dir_scan_t ended = {.end = 0xFFFF};
+      scans[i] = ended;
+      continue;
+    }
+    scans[i] = finish_scan(scan_sector(buf + i * SECTOR_SIZE));
+    if (scans[i].end) {
+      scanned = i + 1;
+    }
+  }
+  return scanned;
+}
@@ -0,0 +1,25 @@
+/* Header file for scan.c, which classifies every entry of a directory sector
+ * at once, using SSE2 or AVX2 where the CPU has them, instead of checking the
+ * entries one at a time. */
+#include "byte.h"
+
+/* Bitmasks over the 16 entries of a directory sector, bit i is entry i.
+ * Only end is set for the entries from the end marker on. */
+typedef struct dir_scan_t {
+  uint16_t end;     // the end marker (first byte 0x00) and all after it.
+  uint16_t deleted; // first byte 0xE5.
+  uint16_t label;   // volume labels.
+  uint16_t dots;    // . and .. entries.
+  uint16_t dirs;    // directories, other than . and ..
+  uint16_t files;   // files with a first cluster.
+  uint16_t used;    // every entry before the end that isn't deleted.
+} dir_scan_t;
+
+/* Scans num_entries raw entries (a multiple of 16, like a sector or the root
+ * directory) into one dir_scan_t per sector. Sectors after the one with the
+ * end marker are left with nothing but end set. Returns the number of
+ * sectors up to and including the one with the end marker. */
+int scan_dirs(byte *buf, int num_entries, dir_scan_t *scans);
+
+// the entries of the sector whose name and extension match the padded name.
+uint16_t scan_name(byte *sector, byte *name83);
@@ -0,0 +1,577 @@
+/* A store of disk images that keeps each distinct sector once. Importing an
+ * image hashes each sector it stores and looks the hash up in a table of the
+ * sectors already in the pack, comparing the bytes as well so a collision
+ * can't mix up two sectors. Opening an image from its manifest gives a FILE
+ * that reads through to the pack, so nothing is rebuilt first. */
+#define _GNU_SOURCE
+#include "store.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+
+/* A pack open for reading, shared by every image opened from the store. It
+ * stays open once opened, so what is cached from it stays useful to images
+ * opened later. */
+typedef struct pack_t {
+  char dir[PATH_MAX];
+  int fd;
+  struct pack_t *next;
+} pack_t;
+
+// an image opened from its manifest, the cookie of the FILE for it.
+typedef struct store_image_t {
+  FILE *file;
+  pack_t *pack;
+  manifest_header_t header;
+  uint32_t *sectors;
+  long pos;
+  struct timespec mtime;
+  struct store_image_t *next;
+} store_image_t;
+
+typedef struct cache_slot_t {
+  pack_t *pack; // NULL if the slot is empty.
+  uint32_t sector;
+  byte data[SECTOR_SIZE];
+} cache_slot_t;
+
+// the packs and images open in the process, and the cache they all share.
+pack_t *packs = NULL;
+store_image_t *images = NULL;
+cache_slot_t *cache = NULL;
+pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void store_path(char *dir, char *file, char *path) {
+  if (snprintf(path, PATH_MAX, "%s/%s", dir, file) >= PATH_MAX) {
+    printf("Error: store path %s is too long.\n", dir);
+    exit(1);
+  }
+}
+
+int is_manifest(char *path) {
+  int len = strlen(path), suffix = strlen(MANIFEST_SUFFIX);
+  return len > suffix && strcmp(path + len - suffix, MANIFEST_SUFFIX) == 0;
+}
+
+// reads exactly len bytes at offset, returns 0 if the file is too short.
+int pread_all(int fd, void *buf, long len, long offset) {
+  for (long done = 0; done < len;) {
+    long n = pread(fd, (byte *)buf + done, len - done, offset + done);
+    if (n <= 0) {
+      return 0;
+    }
+    done += n;
+  }
+  return 1;
+}
+
+void pwrite_all(int fd, void *buf, long len, long offset) {
+  for (long done = 0; done < len;) {
+    long n = pwrite(fd, (byte *)buf + done, len - done, offset + done);
+    if (n <= 0) {
+      printf("Error writing to the store.\n");
+      exit(1);
+    }
+    done += n;
+  }
+}
+
+// the slot a sector of a pack goes in, sectors are spread by a multiply.
+cache_slot_t *cache_slot(uint32_t sector) {
+  return cache + (sector * 2654435761u) % CACHE_SECTORS;
+}
+
+pack_t *open_pack(char *dir) {
+  pthread_mutex_lock(&store_lock);
+  pack_t *pack = packs;
+  while (pack && strcmp(pack->dir, dir) != 0) {
+    pack = pack->next;
+  }
+  if (pack == NULL) {
+    pack = calloc(1, sizeof(pack_t));
+    strcpy(pack->dir, dir);
+    char path[PATH_MAX];
+    store_path(dir, "pack", path);
+    pack->fd = open(path, O_RDONLY);
+    if (pack->fd < 0) {
+      printf("Error: no image store in %s.\n", dir);
+      exit(1);
+    }
+    pack->next = packs;
+    packs = pack;
+  }
+  if (cache == NULL) {
+    cache = calloc(CACHE_SECTORS, sizeof(cache_slot_t));
+  }
+  pthread_mutex_unlock(&store_lock);
+  return pack;
+}
+
+/* Copies the sector of the image into data. On a miss in the cache, reads
+ * the run of sectors from there that are next to each other in the pack too
+ * (up to PACK_RUN), since images imported whole usually are, and caches them
+ * all. The pack is read without holding the lock. */
+int image_sector(store_image_t *image, uint32_t sector, byte *data) {
+  uint32_t first = image->sectors[sector];
+  if (first == NO_SECTOR) {
+    memset(data, 0, SECTOR_SIZE);
+    return 1;
+  }
+  pthread_mutex_lock(&store_lock);
+  cache_slot_t *slot = cache_slot(first);
+  int hit = slot->pack == image->pack && slot->sector == first;
+  if (hit) {
+    memcpy(data, slot->data, SECTOR_SIZE);
+  }
+  pthread_mutex_unlock(&store_lock);
+  if (hit) {
+    return 1;
+  }
+
+  int count = 1;
+  while (count < PACK_RUN && sector + count < image->header.num_sectors &&
+         image->sectors[sector + count] == first + count) {
+    count++;
+  }
+  byte run[PACK_RUN * SECTOR_SIZE];
+  if (!pread_all(image->pack->fd, run, (long)count * SECTOR_SIZE,
+                 (long)first * SECTOR_SIZE)) {
+    errno = EIO;
+    return 0;
+  }
+  pthread_mutex_lock(&store_lock);
+  for (int i = 0; i < count; i++) {
+    slot = cache_slot(first + i);
+    slot->pack = image->pack;
+    slot->sector = first + i;
+    memcpy(slot->data, run + i * SECTOR_SIZE, SECTOR_SIZE);
+  }
+  pthread_mutex_unlock(&store_lock);
+  memcpy(data, run, SECTOR_SIZE);
+  return 1;
+}
+
+ssize_t read_manifest(void *cookie, char *buf, size_t size) {
+  store_image_t *image = cookie;
+  long left = (long)image->header.image_size - image->pos;
+  if (left <= 0) {
+    return 0;
+  }
+  if (size > left) {
+    size = left;
+  }
+  for (size_t done = 0; done < size;) {
+    byte data[SECTOR_SIZE];
+    int offset = image->pos % SECTOR_SIZE;
+    int len = SECTOR_SIZE - offset;
+    if (len > size - done) {
+      len = size - done;
+    }
+    if (!image_sector(image, image->pos / SECTOR_SIZE, data)) {
+      return -1;
+    }
+    memcpy(buf + done, data + offset, len);
+    done += len;
+    image->pos += len;
+  }
+  return size;
+}
+
+int seek_manifest(void *cookie, off64_t *offset, int whence) {
+  store_image_t *image = cookie;
+  long base = (whence == SEEK_SET)   ? 0
+              : (whence == SEEK_CUR) ? image->pos
+                                     : image->header.image_size;
+  if (base + *offset < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  image->pos = base + *offset;
+  *offset = image->pos;
+  return 0;
+}
+
+int close_manifest(void *cookie) {
+  store_image_t *image = cookie;
+  pthread_mutex_lock(&store_lock);
+  store_image_t **link = &images;
+  while (*link != image) {
+    link = &(*link)->next;
+  }
+  *link = image->next;
+  pthread_mutex_unlock(&store_lock);
+  free(image->sectors);
+  free(image);
+  return 0;
+}
+
+FILE *open_manifest(char *manifest, char *attr) {
+  if (strchr(attr, '+') || strchr(attr, 'w')) {
+    printf("Error: %s is in an image store, which is read only.\n", manifest);
+    exit(1);
+  }
+  int fd = open(manifest, O_RDONLY);
+  if (fd < 0) {
+    printf("ERROR: Disk image %s does not exist\n", manifest);
+    exit(1);
+  }
+  store_image_t *image = calloc(1, sizeof(store_image_t));
+  manifest_header_t *header = &image->header;
+  if (!pread_all(fd, header, sizeof(manifest_header_t), 0) ||
+      memcmp(header->magic, MANIFEST_MAGIC, 8) != 0 ||
+      header->version != MANIFEST_VERSION) {
+    printf("Error: %s is not a valid manifest.\n", manifest);
+    exit(1);
+  }
+  // the runs are expanded to the pack sector of each sector of the image.
+  manifest_run_t *runs = malloc(header->num_runs * sizeof(manifest_run_t));
+  image->sectors = malloc(header->num_sectors * sizeof(uint32_t));
+  uint32_t sector = 0;
+  if (!pread_all(fd, runs, header->num_runs * sizeof(manifest_run_t),
+                 sizeof(manifest_header_t))) {
+    printf("Error: %s is not a valid manifest.\n", manifest);
+    exit(1);
+  }
+  for (uint32_t i = 0; i < header->num_runs; i++) {
+    if (runs[i].count > header->num_sectors - sector) {
+      printf("Error: %s is not a valid manifest.\n", manifest);
+      exit(1);
+    }
+    for (uint32_t j = 0; j < runs[i].count; j++) {
+      image->sectors[sector++] =
+          (runs[i].start == NO_SECTOR) ? NO_SECTOR : runs[i].start + j;
+    }
+  }
+  free(runs);
+  if (sector != header->num_sectors) {
+    printf("Error: %s is not a valid manifest.\n", manifest);
+    exit(1);
+  }
+  struct stat attr_buf;
+  fstat(fd, &attr_buf);
+  image->mtime = attr_buf.st_mtim;
+  close(fd);
+
+  // the store is the directory the manifest is in.
+  char dir[PATH_MAX] = ".";
+  char *slash = strrchr(manifest, '/');
+  if (slash) {
+    snprintf(dir, PATH_MAX, "%.*s", (int)(slash - manifest), manifest);
+  }
+  image->pack = open_pack(dir);
+
+  cookie_io_functions_t funcs = {.read = read_manifest,
+                                 .write = NULL,
+                                 .seek = seek_manifest,
+                                 .close = close_manifest};
+  image->file = fopencookie(image, "rb", funcs);
+  pthread_mutex_lock(&store_lock);
+  image->next = images;
+  images = image;
+  pthread_mutex_unlock(&store_lock);
+  return image->file;
+}
+
+int stat_manifest(FILE *disk, struct stat *attr) {
+  pthread_mutex_lock(&store_lock);
+  store_image_t *image = images;
+  while (image && image->file != disk) {
+    image = image->next;
+  }
+  if (image) {
+    memset(attr, 0, sizeof(struct stat));
+    attr->st_size = image->header.image_size;
+    attr->st_mtim = image->mtime;
+  }
+  pthread_mutex_unlock(&store_lock);
+  return image != NULL;
+}
+
+/* The pack being added to by an import. New sectors are kept in pending
+ * until the image is done, then written to the pack in one go. */
+typedef struct packer_t {
+  int pack;
+  FILE *hashes;   // the hash of each sector in the pack, in the same order.
+  uint64_t *hash; // read into memory.
+  uint32_t num_sectors, written, cap;
+  byte *pending; // the sectors from written on.
+  uint32_t pending_cap;
+  uint32_t *table; // open addressing, sector + 1 in each slot, 0 if empty.
+  uint32_t table_size;
+} packer_t;
+
+void table_add(packer_t *packer, uint32_t sector) {
+  uint32_t slot = packer->hash[sector] & (packer->table_size - 1);
+  while (packer->table[slot]) {
+    slot = (slot + 1) & (packer->table_size - 1);
+  }
+  packer->table[slot] = sector + 1;
+}
+
+/* Keeps the table at most half full, so probes stay short. Returns whether
+ * it was rebuilt. */
+int grow_table(packer_t *packer) {
+  if (packer->table && packer->num_sectors * 2 < packer->table_size) {
+    return 0;
+  }
+  free(packer->table);
+  packer->table_size = packer->table_size ? packer->table_size * 2 : 1024;
+  while (packer->num_sectors * 2 >= packer->table_size) {
+    packer->table_size *= 2;
+  }
+  packer->table = calloc(packer->table_size, sizeof(uint32_t));
+  for (uint32_t i = 0; i < packer->num_sectors; i++) {
+    table_add(packer, i);
+  }
+  return 1;
+}
+
+/* Opens the store for adding to, creating it if it doesn't exist. Holds the
+ * writer lock on the hash file until the packer is closed. A crash part way
+ * through an import can leave the pack and hash file different lengths, so
+ * only the sectors in both count, and the rest is written over. */
+packer_t open_packer(char *dir) {
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    printf("Error: could not create image store %s.\n", dir);
+    exit(1);
+  }
+  char path[PATH_MAX];
+  packer_t packer;
+  memset(&packer, 0, sizeof(packer_t));
+  store_path(dir, "pack", path);
+  packer.pack = open(path, O_RDWR | O_CREAT, 0644);
+  store_path(dir, "hashes", path);
+  int hashes = open(path, O_RDWR | O_CREAT, 0644);
+  if (packer.pack < 0 || hashes < 0) {
+    printf("Error: could not open image store %s.\n", dir);
+    exit(1);
+  }
+  packer.hashes = fdopen(hashes, "r+b");
+  lock_byte(packer.hashes, WRITER_LOCK, F_WRLCK);
+
+  struct stat pack_attr, hashes_attr;
+  fstat(packer.pack, &pack_attr);
+  fstat(hashes, &hashes_attr);
+  packer.num_sectors = pack_attr.st_size / SECTOR_SIZE;
+  if (hashes_attr.st_size / sizeof(uint64_t) < packer.num_sectors) {
+    packer.num_sectors = hashes_attr.st_size / sizeof(uint64_t);
+  }
+  packer.written = packer.num_sectors;
+  packer.cap = packer.num_sectors + 1024;
+  packer.hash = malloc(packer.cap * sizeof(uint64_t));
+  if (!pread_all(hashes, packer.hash, packer.num_sectors * sizeof(uint64_t),
+                 0)) {
+    printf("Error reading image store %s.\n", dir);
+    exit(1);
+  }
+  grow_table(&packer);
+  return packer;
+}
+
+/* Returns the sector of the pack with the same bytes as data, adding it to
+ * the pending sectors if there isn't one. */
+uint32_t pack_sector(packer_t *packer, byte *data, uint32_t *added) {
+  uint64_t hash = hash_bytes(data, SECTOR_SIZE);
+  byte packed[SECTOR_SIZE];
+  for (uint32_t slot = hash & (packer->table_size - 1); packer->table[slot];
+       slot = (slot + 1) & (packer->table_size - 1)) {
+    uint32_t sector = packer->table[slot] - 1;
+    if (packer->hash[sector] != hash) {
+      continue;
+    }
+    byte *bytes = packer->pending + (sector - packer->written) * SECTOR_SIZE;
+    if (sector < packer->written) {
+      bytes = packed;
+      if (!pread_all(packer->pack, packed, SECTOR_SIZE,
+                     (long)sector * SECTOR_SIZE)) {
+        printf("Error reading the pack of the image store.\n");
+        exit(1);
+      }
+    }
+    if (memcmp(bytes, data, SECTOR_SIZE) == 0) {
+      return sector;
+    }
+  }
+
+  uint32_t sector = packer->num_sectors++;
+  if (packer->num_sectors > packer->cap) {
+    packer->cap *= 2;
+    packer->hash = realloc(packer->hash, packer->cap * sizeof(uint64_t));
+  }
+  packer->hash[sector] = hash;
+  uint32_t num_pending = packer->num_sectors - packer->written;
+  if (num_pending > packer->pending_cap) {
+    packer->pending_cap = packer->pending_cap ? packer->pending_cap * 2 : 256;
+    packer->pending = realloc(packer->pending, (long)packer->pending_cap *
+                                                   SECTOR_SIZE * sizeof(byte));
+  }
+  memcpy(packer->pending + (num_pending - 1) * SECTOR_SIZE, data, SECTOR_SIZE);
+  // growing the table adds every sector to it, this one included.
+  if (!grow_table(packer)) {
+    table_add(packer, sector);
+  }
+  (*added)++;
+  return sector;
+}
+
+/* Writes the pending sectors and their hashes, and makes sure they are on
+ * disk before any manifest pointing at them is. */
+void flush_packer(packer_t *packer) {
+  uint32_t num_pending = packer->num_sectors - packer->written;
+  pwrite_all(packer->pack, packer->pending, (long)num_pending * SECTOR_SIZE,
+             (long)packer->written * SECTOR_SIZE);
+  pwrite_all(fileno(packer->hashes), packer->hash + packer->written,
+             num_pending * sizeof(uint64_t),
+             packer->written * sizeof(uint64_t));
+  if (fdatasync(packer->pack) != 0 || fdatasync(fileno(packer->hashes)) != 0) {
+    printf("Error writing to the store.\n");
+    exit(1);
+  }
+  packer->written = packer->num_sectors;
+}
+
+void close_packer(packer_t *packer) {
+  close(packer->pack);
+  fclose(packer->hashes);
+  free(packer->hash);
+  free(packer->pending);
+  free(packer->table);
+}
+
+typedef struct data_layout_t {
+  int data_start;
+  int cluster_sectors;
+  int num_clusters;
+} data_layout_t;
+
+/* Reads where the data area starts, the sectors per cluster and the number
+ * of clusters out of the boot sector. Returns 0 if the layout isn't one import
+ * can skip free clusters in, so the whole image is stored instead. */
+int data_layout(fat12_t *fat12, data_layout_t *layout) {
+  byte *boot_sector = fat12->boot_sector;
+  int cluster_sectors = boot_sector[13];
+  int reserved = bytes_to_ushort(boot_sector + 14);
+  int num_fats = boot_sector[16];
+  int root_entries = bytes_to_ushort(boot_sector + 17);
+  int fat_size = bytes_to_ushort(boot_sector + 22);
+  long num_sectors = bytes_to_ushort(boot_sector + 19);
+  if (num_sectors == 0) {
+    num_sectors = bytes_to_uint(boot_sector + 32);
+  }
+  if (bytes_to_ushort(boot_sector + 11) != SECTOR_SIZE ||
+      cluster_sectors == 0 || (cluster_sectors & (cluster_sectors - 1)) ||
+      reserved == 0 || num_fats == 0 || fat_size == 0) {
+    return 0;
+  }
+  layout->data_start = reserved + num_fats * fat_size +
+                       (root_entries * DIR_SIZE + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  layout->cluster_sectors = cluster_sectors;
+  if (num_sectors <= layout->data_start) {
+    return 0;
+  }
+  layout->num_clusters =
+      (num_sectors - layout->data_start) / cluster_sectors + 2;
+  if (layout->num_clusters > fat12->fat.size * 2 / 3) {
+    layout->num_clusters = fat12->fat.size * 2 / 3;
+  }
+  return 1;
+}
+
+/* Stores every sector of the image except those of free clusters. Everything
+ * before the data area (boot sector, FATs and root directory) is always
+ * stored, and so is anything after the last cluster the FAT covers. */
+import_stats_t store_import(char *store_dir, char *image, char *name) {
+  import_stats_t stats = {0};
+  FILE *disk = open_disk(image, "rb");
+  long size;
+  byte *data = map_disk(disk, &size);
+  fat12_t fat12 = fat12_from_file(disk);
+  // with no clusters, nothing is skipped.
+  data_layout_t layout = {.cluster_sectors = 1};
+  if (!data_layout(&fat12, &layout)) {
+    layout.num_clusters = 0;
+  }
+  uint64_t *map = free_map(fat12.fat.table, layout.num_clusters);
+
+  manifest_header_t header;
+  memset(&header, 0, sizeof(manifest_header_t));
+  memcpy(header.magic, MANIFEST_MAGIC, 8);
+  header.version = MANIFEST_VERSION;
+  header.image_size = size;
+  header.num_sectors = (size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  stats.num_sectors = header.num_sectors;
+  // at worst every sector is a run of its own.
+  manifest_run_t *runs = malloc(header.num_sectors * sizeof(manifest_run_t));
+
+  packer_t packer = open_packer(store_dir);
+  for (uint32_t i = 0; i < header.num_sectors; i++) {
+    long cluster =
+        (i < layout.data_start)
+            ? -1
+            : (long)(i - layout.data_start) / layout.cluster_sectors + 2;
+    uint32_t packed = NO_SECTOR;
+    if (cluster < 2 || cluster >= layout.num_clusters ||
+        !((map[cluster / 64] >> (cluster % 64)) & 1)) {
+      // the last sector of an image that isn't whole sectors is padded out.
+      byte sector[SECTOR_SIZE] = {0};
+      long len = size - (long)i * SECTOR_SIZE;
+      memcpy(sector, data + (long)i * SECTOR_SIZE,
+             (len < SECTOR_SIZE) ? len : SECTOR_SIZE);
+      packed = pack_sector(&packer, sector, &stats.added);
+      stats.stored++;
+    }
+    manifest_run_t *last = runs + header.num_runs - 1;
+    if (header.num_runs > 0 &&
+        ((packed == NO_SECTOR && last->start == NO_SECTOR) ||
+         (packed != NO_SECTOR && last->start != NO_SECTOR &&
+          packed == last->start + last->count))) {
+      last->count++;
+    } else {
+      manifest_run_t run = {.start = packed, .count = 1};
+      runs[header.num_runs++] = run;
+    }
+  }
+  stats.num_runs = header.num_runs;
+  flush_packer(&packer);
+
+  /* The manifest replaces any old one of the same name in one rename. It is
+   * synced first, and the directory after, so a crash leaves either the old
+   * manifest or the whole new one. */
+  char file[PATH_MAX], path[PATH_MAX], tmp_path[PATH_MAX + 16];
+  snprintf(file, PATH_MAX, "%s%s", name, MANIFEST_SUFFIX);
+  store_path(store_dir, file, path);
+  snprintf(tmp_path, PATH_MAX + 16, "%s.%d.tmp", path, getpid());
+  FILE *manifest = fopen(tmp_path, "wb");
+  int dir_fd = -1;
+  if (manifest == NULL ||
+      fwrite(&header, sizeof(manifest_header_t), 1, manifest) < 1 ||
+      fwrite(runs, sizeof(manifest_run_t), header.num_runs, manifest) <
+          header.num_runs ||
+      fflush(manifest) != 0 || fsync(fileno(manifest)) != 0 ||
+      fclose(manifest) != 0 || rename(tmp_path, path) != 0 ||
+      (dir_fd = open(store_dir, O_RDONLY | O_DIRECTORY)) < 0 ||
+      fsync(dir_fd) != 0) {
+    printf("Error: could not write manifest %s.\n", path);
+    exit(1);
+  }
+  close(dir_fd);
+  close_packer(&packer);
+
+  free(runs);
+  free(map);
+  free_fat12(fat12);
+  munmap(data, size);
+  fclose(disk);
+  return stats;
+}
+
+uint32_t pack_sectors(char *store_dir) {
+  char path[PATH_MAX];
+  struct stat attr;
+  store_path(store_dir, "pack", path);
+  if (stat(path, &attr) != 0) {
+    return 0;
+  }
+  return attr.st_size / SECTOR_SIZE;
+}
@@ -0,0 +1,52 @@
+/* Header file for store.c, which keeps many disk images in one directory with
+ * each distinct sector stored once. The store holds a pack file of sectors,
+ * a file of their hashes, and a <NAME>.manifest for each image that lists the
+ * sector of the pack each of its sectors is in. Free clusters (by the FAT)
+ * aren't stored at all, and read back as zeros.
+ *
+ * open_disk opens an image from its manifest directly, so every tool can
+ * read it in place. Sectors read from the pack are kept in a cache shared by
+ * every image open in the process. Images in the store are read only. */
+#include "fat12.h"
+
+#define MANIFEST_MAGIC "FAT12MAN"
+#define MANIFEST_VERSION 1
+#define MANIFEST_SUFFIX ".manifest"
+// the sector of an image that isn't stored, because its cluster is free.
+#define NO_SECTOR 0xFFFFFFFF
+
+// sectors kept in the shared cache, 2 MB of them.
+#define CACHE_SECTORS 4096
+// the most sectors read from the pack in one read.
+#define PACK_RUN 64
+
+/* A manifest is this header followed by num_runs runs, which cover the
+ * sectors of the image in order. */
+typedef struct manifest_header_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t image_size;
+  uint32_t num_sectors;
+  uint32_t num_runs;
+} manifest_header_t;
+
+/* count sectors of the image that are in the pack one after another from
+ * start, or that aren't stored if start is NO_SECTOR. */
+typedef struct manifest_run_t {
+  uint32_t start;
+  uint32_t count;
+} manifest_run_t;
+
+// what importing one image added to the store.
+typedef struct import_stats_t {
+  uint32_t num_sectors; // sectors in the image.
+  uint32_t stored;      // sectors of it stored, rather than free.
+  uint32_t added;       // sectors new to the pack.
+  uint32_t num_runs;    // runs in its manifest.
+} import_stats_t;
+
+/* Adds the image to the store in store_dir as <name>.manifest. Imports are
+ * serialised with a lock on the store, readers aren't blocked. */
+import_stats_t store_import(char *store_dir, char *image, char *name);
+// the number of sectors in the pack.
+uint32_t pack_sectors(char *store_dir);
@@ -0,0 +1,70 @@
+/* Double buffered copying between a reader thread and the calling thread, so
+ * one buffer can be filled while the other is written out. */
+#include "stream.h"
+
+typedef struct stream_t {
+  byte *bufs[2];
+  int lens[2];
+  int full[2];
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  fill_fn fill;
+  void *ctx;
+} stream_t;
+
+// waits until buffer i is full (or empty), with the lock held.
+void wait_for(stream_t *stream, int i, int full) {
+  pthread_mutex_lock(&stream->lock);
+  while (stream->full[i] != full) {
+    pthread_cond_wait(&stream->cond, &stream->lock);
+  }
+  pthread_mutex_unlock(&stream->lock);
+}
+
+void set_full(stream_t *stream, int i, int full) {
+  pthread_mutex_lock(&stream->lock);
+  stream->full[i] = full;
+  pthread_cond_signal(&stream->cond);
+  pthread_mutex_unlock(&stream->lock);
+}
+
+/* Fills the two buffers in turn, waiting for the other thread to empty each
+ * one before filling it again. A fill of 0 bytes marks the end. */
+void *reader(void *arg) {
+  stream_t *stream = arg;
+  for (int i = 0;; i ^= 1) {
+    wait_for(stream, i, 0);
+    stream->lens[i] = stream->fill(stream->ctx, stream->bufs[i],
+                                   STREAM_BUF_SIZE);
+    set_full(stream, i, 1);
+    if (stream->lens[i] == 0) {
+      return NULL;
+    }
+  }
+}
+
+void double_buffer(fill_fn fill, void *fill_ctx, drain_fn drain,
+                   void *drain_ctx) {
+  stream_t stream = {.full = {0, 0}, .fill = fill, .ctx = fill_ctx};
+  stream.bufs[0] = malloc(STREAM_BUF_SIZE * sizeof(byte));
+  stream.bufs[1] = malloc(STREAM_BUF_SIZE * sizeof(byte));
+  pthread_mutex_init(&stream.lock, NULL);
+  pthread_cond_init(&stream.cond, NULL);
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, reader, &stream);
+  for (int i = 0;; i ^= 1) {
+    wait_for(&stream, i, 1);
+    if (stream.lens[i] == 0) {
+      break;
+    }
+    drain(drain_ctx, stream.bufs[i], stream.lens[i]);
+    set_full(&stream, i, 0);
+  }
+  pthread_join(thread, NULL);
+
+  pthread_mutex_destroy(&stream.lock);
+  pthread_cond_destroy(&stream.cond);
+  free(stream.bufs[0]);
+  free(stream.bufs[1]);
+}
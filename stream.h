@@ -0,0 +1,14 @@
+/* Header file for stream.c, which overlaps reading from one file with
+ * writing to another, using a reader thread and two buffers. */
+#include "byte.h"
+#include <pthread.h>
+
+#define STREAM_BUF_SIZE (64 * 512)
+
+/* fill reads up to cap bytes into buf and returns how many it read,
+ * 0 once there is nothing left. drain writes the len bytes in buf out. */
+typedef int (*fill_fn)(void *ctx, byte *buf, int cap);
+typedef void (*drain_fn)(void *ctx, byte *buf, int len);
+
+void double_buffer(fill_fn fill, void *fill_ctx, drain_fn drain,
+                   void *drain_ctx);
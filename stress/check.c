@@ -0,0 +1,99 @@
+/* Reader for the stress test: opens the image again and again for the given
+ * number of seconds, and checks each time that the tree it sees is whole.
+ * Every chain must be as long as its file needs, no cluster may be in two
+ * chains, every allocated cluster must be in one, and the files the writers
+ * make (named W...) must hold a single repeated byte. Prints the number of
+ * walks and how many of them saw a torn image. */
+#include "../fat12.h"
+#include <time.h>
+
+byte *owner;
+fat12_t fat12;
+FILE *disk;
+
+// returns a bitmask of the checks that failed under this directory.
+int check_dir(byte *buf, int num_entries) {
+  int bad = 0;
+  dir_scan_t *scans = malloc((num_entries / 16 + 1) * sizeof(dir_scan_t));
+  int num_scans = scan_dirs(buf, num_entries, scans);
+  for (int s = 0; s < num_scans; s++) {
+    for (ushort mask = scans[s].dirs | scans[s].files; mask;
+         mask &= mask - 1) {
+      directory_t *entry =
+          (directory_t *)(buf + (s * 16 + __builtin_ctz(mask)) * DIR_SIZE);
+      int first = bytes_to_ushort(entry->first_cluster);
+      int len = 0;
+      for (int c = first; c > 1 && c < LAST_SECTOR;
+           c = fat_entry(fat12.fat.table, c)) {
+        if (owner[c]) {
+          bad |= 1;
+        }
+        owner[c] = 1;
+        if (++len > 4096) {
+          bad |= 2;
+          break;
+        }
+      }
+      if (entry->attribute & DIR_MASK) {
+        ushort cluster = first;
+        int size;
+        byte **dirs = read_dir_batch(disk, fat12.fat.table, &cluster, 1, &size);
+        bad |= check_dir(dirs[0], size);
+        free(dirs[0]);
+        free(dirs);
+        continue;
+      }
+      int size = bytes_to_uint(entry->file_size);
+      if (len != (size ? (size + SECTOR_SIZE - 1) / SECTOR_SIZE : 1)) {
+        bad |= 4;
+      } else if (entry->filename[0] == 'W') {
+        byte *data = malloc(len * SECTOR_SIZE);
+        read_req_t *reqs = malloc(len * sizeof(read_req_t));
+        int index = first;
+        int num_reqs = chain_reads(fat12.fat.table, &index, len, data, reqs);
+        read_batch(disk, reqs, num_reqs);
+        for (int i = 1; i < size; i++) {
+          if (data[i] != data[0]) {
+            bad |= 8;
+            break;
+          }
+        }
+        free(data);
+        free(reqs);
+      }
+    }
+  }
+  free(scans);
+  return bad;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    printf("Usage: %s <IMAGE_NAME>.IMA <SECONDS>\n", argv[0]);
+    exit(1);
+  }
+  time_t end = time(NULL) + atoi(argv[2]);
+  long walks = 0, torn = 0;
+  do {
+    disk = open_disk(argv[1], "rb");
+    fat12 = fat12_from_file(disk);
+    owner = calloc(LAST_SECTOR, sizeof(byte));
+    byte root[ROOT_DIR_SIZE];
+    read_from_disk(disk, root, ROOT * SECTOR_SIZE, ROOT_DIR_SIZE, 1);
+    int bad = check_dir(root, ROOT_DIR_SIZE / DIR_SIZE);
+    for (int i = 2; i < fat12.fat.valid_sectors && !bad; i++) {
+      if (fat_entry(fat12.fat.table, i) && !owner[i]) {
+        bad |= 16;
+      }
+    }
+    if (bad) {
+      fprintf(stderr, "torn image, checks failed: %d\n", bad);
+      torn++;
+    }
+    walks++;
+    free(owner);
+    free_fat12(fat12);
+    fclose(disk);
+  } while (time(NULL) < end);
+  printf("%ld %ld\n", walks, torn);
+}
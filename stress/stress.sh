@@ -0,0 +1,24 @@
+#!/bin/bash
+# stress/stress.sh [READERS] [WRITERS] [SECONDS]
+# Runs writers syncing into one image while readers walk it over and over,
+# and fails if any reader saw a torn image. Run from the top of the repo,
+# after building the tools and stress/check (make stress does both).
+readers=${1:-4}; writers=${2:-2}; seconds=${3:-10}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+image=$dir/stress.ima
+./diskformat "$image" > /dev/null || exit 1
+
+for n in $(seq 1 "$writers"); do
+  stress/writer.sh "$n" "$image" "$dir" "$seconds" &
+done
+for n in $(seq 1 "$readers"); do
+  stress/check "$image" "$seconds" > "$dir/r$n.out" 2> "$dir/r$n.err" &
+done
+wait
+
+cat "$dir"/r*.out | awk -v s="$seconds" '{ walks += $1; torn += $2 }
+  END { printf "reader walks: %d (%.0f/s), torn: %d\n", walks, walks / s, torn }'
+sort "$dir"/r*.err | uniq -c | head
+./diskinfo "$image" --fields files,free
+! grep -q torn "$dir"/r*.err
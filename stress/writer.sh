@@ -0,0 +1,22 @@
+#!/bin/bash
+# stress/writer.sh N IMAGE DIR SECONDS
+# Keeps rewriting, adding and deleting files in DIR/hN on the host, and syncs
+# it into directory DN of the image each time. Every file is one repeated
+# digit, so the readers can tell a torn file from a whole one.
+n=$1; image=$2; host=$3/h$n; end=$(($(date +%s) + $4))
+mkdir -p "$host"
+fill() {
+  head -c "$2" /dev/zero | tr '\0' "$((RANDOM % 10))" > "$host/$1"
+}
+syncs=0
+while [ "$(date +%s)" -lt "$end" ]; do
+  for k in 1 2 3; do
+    fill "W${n}K$k.BIN" $((RANDOM % 6000 + 1))
+  done
+  rm -f "$host/W${n}K$((RANDOM % 6)).BIN"
+  fill "W${n}K$((RANDOM % 3 + 3)).BIN" $((RANDOM % 3000 + 1))
+  ./diskput "$image" --sync "$host" "D$n" --delete > /dev/null ||
+    echo "writer $n: sync failed"
+  syncs=$((syncs + 1))
+done
+echo "writer $n: $syncs syncs"
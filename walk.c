@@ -0,0 +1,305 @@
+/* Parallel traversal of the directory tree with work stealing. A thread
+ * takes the newest task from the bottom of its own deque, so it goes depth
+ * first through what it found itself, and steals the oldest task from the
+ * top of another thread's deque, which is usually the biggest subtree. */
+#include "fat12.h"
+#include "walk.h"
+
+typedef struct deque_t {
+  walk_dir_t **tasks;
+  int top, bottom, cap; // the tasks are tasks[top] to tasks[bottom - 1].
+  pthread_mutex_t lock;
+} deque_t;
+
+typedef struct walk_t {
+  FILE *disk;
+  byte *fat_table;
+  visit_fn visit;
+  void *ctx;
+  int num_threads;
+  deque_t deques[WALK_MAX_THREADS];
+  int pending; // tasks not finished yet, including the queued ones.
+  int queued;  // tasks waiting in a deque.
+  // idle threads wait on work until something is queued or all is done.
+  pthread_mutex_t idle_lock;
+  pthread_cond_t work;
+} walk_t;
+
+typedef struct worker_t {
+  walk_t *walk;
+  int thread;
+} worker_t;
+
+int walk_threads() {
+  char *env = getenv("FAT12_THREADS");
+  int num = env ? atoi(env) : 1;
+  if (num < 1) {
+    return 1;
+  }
+  return (num < WALK_MAX_THREADS) ? num : WALK_MAX_THREADS;
+}
+
+// wakes the idle threads, after something was queued or the walk finished.
+void wake_idle(walk_t *walk) {
+  pthread_mutex_lock(&walk->idle_lock);
+  pthread_cond_broadcast(&walk->work);
+  pthread_mutex_unlock(&walk->idle_lock);
+}
+
+void push_task(walk_t *walk, int thread, walk_dir_t *task) {
+  deque_t *deque = walk->deques + thread;
+  __atomic_add_fetch(&walk->pending, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_lock(&deque->lock);
+  if (deque->bottom == deque->cap) {
+    deque->cap = deque->cap ? deque->cap * 2 : 64;
+    deque->tasks = realloc(deque->tasks, deque->cap * sizeof(walk_dir_t *));
+  }
+  deque->tasks[deque->bottom++] = task;
+  pthread_mutex_unlock(&deque->lock);
+  __atomic_add_fetch(&walk->queued, 1, __ATOMIC_SEQ_CST);
+  wake_idle(walk);
+}
+
+// takes a task from the bottom of the deque, or the top when stealing.
+walk_dir_t *take_task(walk_t *walk, int thread, int steal) {
+  deque_t *deque = walk->deques + thread;
+  walk_dir_t *task = NULL;
+  pthread_mutex_lock(&deque->lock);
+  if (deque->bottom > deque->top) {
+    task = steal ? deque->tasks[deque->top++] : deque->tasks[--deque->bottom];
+    if (deque->top == deque->bottom) {
+      deque->top = deque->bottom = 0;
+    }
+  }
+  pthread_mutex_unlock(&deque->lock);
+  if (task) {
+    __atomic_sub_fetch(&walk->queued, 1, __ATOMIC_SEQ_CST);
+  }
+  return task;
+}
+
+walk_dir_t *find_task(walk_t *walk, int thread) {
+  walk_dir_t *task = take_task(walk, thread, 0);
+  for (int i = 1; task == NULL && i < walk->num_threads; i++) {
+    task = take_task(walk, (thread + i) % walk->num_threads, 1);
+  }
+  return task;
+}
+
+/* Reads all the sectors of the directory, submitting every run of clusters
+ * in one batch. Each thread has its own ring (see aio.c), so the batches of
+ * different threads overlap too. Sets num_entries to the number read. */
+byte *read_walk_dir(walk_t *walk, walk_dir_t *dir, int *num_entries) {
+  if (dir->cluster == 0) {
+    byte *buf = malloc(ROOT_DIR_SIZE * sizeof(byte));
+    read_req_t req = {
+        .buf = buf, .offset = ROOT * SECTOR_SIZE, .len = ROOT_DIR_SIZE};
+    read_batch(walk->disk, &req, 1);
+    *num_entries = DIRS_IN_ROOT;
+    return buf;
+  }
+  int length = chain_length(walk->fat_table, dir->cluster);
+  byte *buf = malloc(length * SECTOR_SIZE * sizeof(byte));
+  read_req_t reqs[length];
+  int index = dir->cluster;
+  int num_reqs = chain_reads(walk->fat_table, &index, length, buf, reqs);
+  read_batch(walk->disk, reqs, num_reqs);
+  *num_entries = length * DIRS_PER_SECTOR;
+  return buf;
+}
+
+/* Scans the directory read into buf, adds a child for each of its
+ * subdirectories, queues them as tasks if the walk has several threads, then
+ * hands the directory to visit. Frees buf. */
+void visit_walk_dir(walk_t *walk, walk_dir_t *dir, byte *buf, int num_entries,
+                    int thread) {
+  dir_scan_t *scans =
+      malloc(num_entries / DIRS_PER_SECTOR * sizeof(dir_scan_t));
+  int num_sectors = scan_dirs(buf, num_entries, scans);
+
+  for (int i = 0; i < num_sectors; i++) {
+    dir->num_children += __builtin_popcount(scans[i].dirs);
+  }
+  dir->children = malloc(dir->num_children * sizeof(walk_dir_t *));
+  int n = 0;
+  for (int i = 0; i < num_sectors; i++) {
+    for (uint16_t dirs = scans[i].dirs; dirs; dirs &= dirs - 1) {
+      directory_t *entry = (directory_t *)(buf + SECTOR_SIZE * i +
+                                           DIR_SIZE * __builtin_ctz(dirs));
+      walk_dir_t *child = calloc(1, sizeof(walk_dir_t));
+      // names end at the first space, like bytes_to_filename.
+      int len = 0;
+      while (len < 8 && entry->filename[len] != 0x20) {
+        len++;
+      }
+      if (snprintf(child->path, 200, "%s/%.*s", dir->path, len,
+                   entry->filename) >= 200) {
+        printf("Error: directory path too long: %s\n", child->path);
+        exit(1);
+      }
+      child->cluster = bytes_to_ushort(entry->first_cluster);
+      dir->children[n++] = child;
+    }
+  }
+  // queued last child first, so this thread goes on with the first one.
+  for (int i = dir->num_children - 1; walk->num_threads > 1 && i >= 0; i--) {
+    push_task(walk, thread, dir->children[i]);
+  }
+
+  walk->visit(walk->ctx, dir, buf, scans, num_sectors, thread);
+  free(buf);
+  free(scans);
+}
+
+void walk_dir(walk_t *walk, walk_dir_t *dir, int thread) {
+  int num_entries;
+  byte *buf = read_walk_dir(walk, dir, &num_entries);
+  visit_walk_dir(walk, dir, buf, num_entries, thread);
+}
+
+/* Walks the tree on the calling thread alone, a level at a time. Every
+ * directory of a level is read in one batch, so on slow storage their reads
+ * are all in flight at once, rather than waiting on one directory at a time.
+ * Directories are visited breadth first. */
+void walk_levels(walk_t *walk, walk_dir_t *root) {
+  walk_dir(walk, root, 0);
+  walk_dir_t **level = malloc(root->num_children * sizeof(walk_dir_t *));
+  memcpy(level, root->children, root->num_children * sizeof(walk_dir_t *));
+  int num_dirs = root->num_children;
+  while (num_dirs > 0) {
+    ushort *clusters = malloc(num_dirs * sizeof(ushort));
+    int *sizes = malloc(num_dirs * sizeof(int));
+    for (int i = 0; i < num_dirs; i++) {
+      clusters[i] = level[i]->cluster;
+    }
+    byte **bufs =
+        read_dir_batch(walk->disk, walk->fat_table, clusters, num_dirs, sizes);
+    int next_size = 0;
+    for (int i = 0; i < num_dirs; i++) {
+      visit_walk_dir(walk, level[i], bufs[i], sizes[i], 0);
+      next_size += level[i]->num_children;
+    }
+    walk_dir_t **next = malloc(next_size * sizeof(walk_dir_t *));
+    int n = 0;
+    for (int i = 0; i < num_dirs; i++) {
+      memcpy(next + n, level[i]->children,
+             level[i]->num_children * sizeof(walk_dir_t *));
+      n += level[i]->num_children;
+    }
+    free(bufs);
+    free(sizes);
+    free(clusters);
+    free(level);
+    level = next;
+    num_dirs = next_size;
+  }
+  free(level);
+}
+
+void *walk_worker(void *arg) {
+  worker_t *worker = arg;
+  walk_t *walk = worker->walk;
+  while (1) {
+    walk_dir_t *task = find_task(walk, worker->thread);
+    if (task) {
+      walk_dir(walk, task, worker->thread);
+      if (__atomic_sub_fetch(&walk->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+        wake_idle(walk);
+      }
+      continue;
+    }
+    pthread_mutex_lock(&walk->idle_lock);
+    while (__atomic_load_n(&walk->queued, __ATOMIC_SEQ_CST) == 0 &&
+           __atomic_load_n(&walk->pending, __ATOMIC_SEQ_CST) > 0) {
+      pthread_cond_wait(&walk->work, &walk->idle_lock);
+    }
+    int done = __atomic_load_n(&walk->pending, __ATOMIC_SEQ_CST) == 0;
+    pthread_mutex_unlock(&walk->idle_lock);
+    if (done) {
+      return NULL;
+    }
+  }
+}
+
+/* Walks every directory under the root on num_threads threads (the calling
+ * thread being one of them), calling visit for each one. With one thread the
+ * tree is walked a level at a time, see walk_levels. Returns the tree of
+ * directories, with whatever visit kept in them. */
+walk_dir_t *walk_tree(FILE *disk, byte *fat_table, int num_threads,
+                      visit_fn visit, void *ctx) {
+  walk_t *walk = calloc(1, sizeof(walk_t));
+  walk->disk = disk;
+  walk->fat_table = fat_table;
+  walk->visit = visit;
+  walk->ctx = ctx;
+  walk->num_threads = num_threads;
+  pthread_mutex_init(&walk->idle_lock, NULL);
+  pthread_cond_init(&walk->work, NULL);
+  for (int i = 0; i < num_threads; i++) {
+    pthread_mutex_init(&walk->deques[i].lock, NULL);
+  }
+
+  walk_dir_t *root = calloc(1, sizeof(walk_dir_t));
+  strcpy(root->path, "Root");
+  if (num_threads == 1) {
+    walk_levels(walk, root);
+  } else {
+    push_task(walk, 0, root);
+    pthread_t threads[WALK_MAX_THREADS];
+    worker_t workers[WALK_MAX_THREADS];
+    for (int i = 0; i < num_threads; i++) {
+      worker_t worker = {.walk = walk, .thread = i};
+      workers[i] = worker;
+    }
+    for (int i = 1; i < num_threads; i++) {
+      pthread_create(threads + i, NULL, walk_worker, workers + i);
+    }
+    walk_worker(workers);
+    for (int i = 1; i < num_threads; i++) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+
+  for (int i = 0; i < num_threads; i++) {
+    pthread_mutex_destroy(&walk->deques[i].lock);
+    free(walk->deques[i].tasks);
+  }
+  pthread_mutex_destroy(&walk->idle_lock);
+  pthread_cond_destroy(&walk->work);
+  free(walk);
+  return root;
+}
+
+void free_walk(walk_dir_t *dir) {
+  for (int i = 0; i < dir->num_children; i++) {
+    free_walk(dir->children[i]);
+  }
+  free(dir->children);
+  free(dir->result);
+  free(dir);
+}
+
+// threads count into their own slot, a cache line apart from the others.
+#define COUNT_STRIDE 16
+
+void count_dir(void *ctx, walk_dir_t *dir, byte *buf, dir_scan_t *scans,
+               int num_sectors, int thread) {
+  int *counts = ctx;
+  for (int i = 0; i < num_sectors; i++) {
+    counts[thread * COUNT_STRIDE] += __builtin_popcount(scans[i].files);
+  }
+}
+
+/* performs a complete filesystem traversal, counting every file encountered.
+ * Each thread of the walk counts the files it comes across, and the counts
+ * are added up at the end. */
+int count_files(FILE *disk, byte *fat_table) {
+  int counts[WALK_MAX_THREADS * COUNT_STRIDE] = {0};
+  int num_threads = walk_threads();
+  free_walk(walk_tree(disk, fat_table, num_threads, count_dir, counts));
+  int num = 0;
+  for (int i = 0; i < num_threads; i++) {
+    num += counts[i * COUNT_STRIDE];
+  }
+  return num;
+}
@@ -0,0 +1,31 @@
+/* Header file for walk.c, which walks the whole directory tree of an image on
+ * several threads. Each directory found becomes a task on the deque of the
+ * thread that found it, and threads that run out of tasks steal them from
+ * the other threads' deques. */
+// uses the types from fat12.h, which is included before this.
+#include <pthread.h>
+
+#define WALK_MAX_THREADS 64
+
+/* A directory in the tree. children are its subdirectories in the order of
+ * their entries, so going through the tree depth first visits directories
+ * in the order disklist prints them. */
+typedef struct walk_dir_t {
+  char path[200]; // e.g. "Root/SUB1"
+  ushort cluster; // 0 for the root directory.
+  struct walk_dir_t **children;
+  int num_children;
+  void *result; // anything visit keeps for later, freed with the tree.
+} walk_dir_t;
+
+/* Called on one of the walk's threads for each directory, with its raw
+ * entries and the scan of each sector. thread is the index of the thread,
+ * so reducers can keep a result per thread and combine them afterwards. */
+typedef void (*visit_fn)(void *ctx, walk_dir_t *dir, byte *buf,
+                         dir_scan_t *scans, int num_sectors, int thread);
+
+// $FAT12_THREADS if it is set, otherwise 1. More threads are opt-in.
+int walk_threads();
+walk_dir_t *walk_tree(FILE *disk, byte *fat_table, int num_threads,
+                      visit_fn visit, void *ctx);
+void free_walk(walk_dir_t *dir);